@@ -22,11 +22,14 @@
              +----------------+ <- AES key
     0        |                |
     1        |                |
+             +----------------+ <- Format block (absent in legacy archives)
+    2        |AARv0001.       |
+    3        |                |
              +----------------+ <- Record header
-    2        |                |
-    3        |        ........|
-             +----------------+ <- Record description
     4        |                |
+    5        |        ........|
+             +----------------+ <- Record description
+    6        |                |
            //////////////////////
     Rn       |     ...........|
              +----------------+ <- Record data
@@ -34,7 +37,7 @@
     D1       |                |
            //////////////////////
     Dn       |       .........|
-             +----------------+
+             +----------------+ <- More records, then the record index
 */
 
 #ifndef _AAR_H_
@@ -49,6 +52,13 @@ typedef u32 aar_checksum;
 #define AAR_CHECKSUM_SIZE   sizeof(aar_checksum)
 #define AAR_CHECKSUM_INIT    0
 
+// Algorithm behind every checksum in an archive.
+typedef enum {
+	AAR_CHECKSUM_BSD    = 0, // Rotate-and-add. Archives without a format block.
+	AAR_CHECKSUM_CRC32C = 1, // Castagnoli CRC. Default for new archives.
+} aar_checksum_kind;
+TYPEDEF_OK(aar_checksum_kind);
+
 #define sizeof_member(type, member) (sizeof(((type){0}).member))
 
 
@@ -92,6 +102,11 @@ TYPEDEF_OK(aar_record_header);
 			? AAR_PADDING((hdr).desc_length + AAR_CHECKSUM_SIZE) \
 			: 0))
 
+// Upper bound on AAR_HDR_BYTES() for any header. The 2 extra blocks
+// cover the padding of the min section and the desc section.
+#define AAR_HDR_BYTES_MAX						\
+	(AAR_RECORD_MAX + 2 * AAR_CHECKSUM_SIZE + 2 * AAR_BLOCK_SIZE)
+
 // The full block length of a record's header that is written to disk.
 #define AAR_HDR_BLOCKS(hdr) (AAR_HDR_BYTES(hdr) / AAR_BLOCK_SIZE)
 
@@ -101,10 +116,71 @@ TYPEDEF_OK(aar_record_header);
 // The entire record's byte length.
 #define AAR_REC_BYTES(hdr)  (AAR_HDR_BYTES(hdr) + AAR_DATA_BYTES(hdr))
 
+// Archives start with the encrypted key. Archives made before the
+// format block existed have nothing else in their header.
 #define AAR_FILE_HEADER_SIZE AAR_KEY_SIZE
 
-// TODO: Use a magic version block
-// #define AAR_MAGIC_VERSION    $("AARv0000")                             // Defines the version of the archive file format
-// #define AAR_FILE_HEADER_SIZE (AAR_MAGIC_VERSION.length + AAR_KEY_SIZE) // (sizeof(AAR_MAGIC_VERSION) + AAR_KEY_SIZE)
+// The format block follows the key and is encrypted with it. A
+// standalone file carries one at offset 0 unless it uses the legacy
+// format: the BSD checksum with unaligned records. Its absence means
+// the legacy format.
+#define AAR_MAGIC_VERSION "AARv0001"
+#define AAR_MAGIC_SIZE    Bytes(8)
+#define AAR_FORMAT_SIZE   Bytes(32)
+
+// Largest record alignment, as a power of 2.
+#define AAR_ALIGN_MAX_SHIFT 30
+
+// Format flags
+#define AAR_FORMAT_LOG 0x01 // Deletes and renames are appended
+
+typedef struct {
+	aar_checksum_kind checksum;
+	size align;         // Records start at multiples of this. 0 if packed.
+	size index;         // Byte offset of the record index. 0 if none.
+	size index_length;  // Byte length of the record index.
+	bool log;           // Deletes and renames are appended.
+} aar_format;
+TYPEDEF_OK(aar_format);
+
+// On disk, in AAR_FORMAT_SIZE bytes:
+//   magic[8]     AAR_MAGIC_VERSION
+//   checksum     u8, aar_checksum_kind
+//   align        u8, log2 of the alignment or 0 if packed
+//   flags        u8, AAR_FORMAT_* bits
+//   reserved     Zeros up to byte 16
+//   index        u64, byte offset of the record index or 0 if none
+//   index_length u64
+//
+// In an aligned archive, the first record and every record after it
+// is padded with zeros up to the next multiple of the alignment. That
+// lets records be removed and inserted as whole filesystem blocks.
+//
+// In a log archive, delete and rename don't touch existing records.
+// They append a record that refers to an earlier one by the byte
+// offset of its header. That offset is its only data block. Its
+// block_offset, which is below AAR_BLOCK_SIZE for file data, says
+// what it does. A rename carries the new description. The `compact`
+// command applies them by rewriting the archive.
+#define AAR_RECORD_DELETE (~(u64) 0)
+#define AAR_RECORD_RENAME (~(u64) 1)
+#define AAR_RECORD_IS_LOG(hdr) ((hdr).block_offset >= AAR_BLOCK_SIZE)
+
+// The record index follows the last record of an archive that has a
+// format block. It lets a record be found without decrypting every
+// header before it. It's encrypted like the rest of the archive:
+//   count        u64, number of records
+//   checksum     aar_checksum of count and every entry
+//   reserved     Zeros up to AAR_INDEX_HEADER_SIZE
+// followed by count entries of
+//   offset       u64, byte offset of the record header
+//   block_count  u64
+//   block_offset u64
+//   desc_length  u32
+//   checksum     aar_checksum of the record's data
+//   desc         Padded with zeros to a multiple of AAR_BLOCK_SIZE
+#define AAR_INDEX_HEADER_SIZE Bytes(16)
+#define AAR_INDEX_ENTRY_MIN   Bytes(32)
+#define AAR_INDEX_ENTRY_SIZE(desc_length) (AAR_INDEX_ENTRY_MIN + AAR_PADDING(desc_length))
 
 #endif // _AAR_H_
@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  Micro-benchmarks for aar's hot kernels.
+
+  This pulls in the unity build without aar's main(), so it is built
+  with the same macro flags as aar itself. Build one binary per crypto
+  backend to compare them (`bmake bench` does this):
+
+      cc -O2 -D AAR_OS_POSIX -D AAR_CRYPT_AESNI -o bench-aesni bench.c -lpthread
+
+  Every kernel is timed over buffer sizes from 16 bytes up to --max,
+  growing by a factor of 4. Results are printed as a table, and
+  --json=FILE also writes them as JSON. Cycles are read from the time
+  stamp counter and are only reported on x86.
+
+  Usage: bench [--max=BYTES] [--jobs=N] [--json=FILE]
+*/
+
+#define AAR_NO_MAIN
+#include "build.c"
+
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#     include <x86intrin.h>
+#     define BENCH_HAS_TSC
+#endif
+
+#if defined AAR_CRYPT_LIBTOM
+#     define BENCH_BACKEND "libtomcrypt"
+#elif defined AAR_CRYPT_AESNI
+#     define BENCH_BACKEND "aesni"
+#elif defined AAR_CRYPT_BITSLICE
+#     define BENCH_BACKEND "bitslice"
+#else
+#     define BENCH_BACKEND "aes256"
+#endif
+
+// Don't report a measurement until it ran at least this long.
+#define BENCH_MIN_SECONDS 0.2
+
+typedef struct {
+	aar_cipher cipher;
+	byte* buf;      // Kernel input, at least --max bytes
+	byte* b64;      // Base64 text of buf
+	size len;       // Bytes the kernel works on
+	size jobs;
+	aar_checksum chk;
+} bench_state;
+
+typedef struct {
+	const char* name;
+	void (*run)(bench_state* st);
+} bench_kernel;
+
+static void
+RunEncrypt(bench_state* st)
+{
+	EncryptBlocks(st->buf, AAR_BLOCKS(st->len), &st->cipher);
+}
+
+static void
+RunDecrypt(bench_state* st)
+{
+	DecryptBlocks(st->buf, AAR_BLOCKS(st->len), &st->cipher);
+}
+
+static void
+RunEncryptParallel(bench_state* st)
+{
+	EncryptBlocksParallel(st->buf, AAR_BLOCKS(st->len), &st->cipher, st->jobs);
+}
+
+static void
+RunEncryptChecksum(bench_state* st)
+{
+	st->chk = EncryptChecksum(AAR_CHECKSUM_CRC32C, st->chk, st->buf, st->len, &st->cipher, 1);
+}
+
+static void
+RunChecksumBsd(bench_state* st)
+{
+	st->chk = Checksum(AAR_CHECKSUM_BSD, st->chk, (u8*) st->buf, st->len);
+}
+
+static void
+RunChecksumCrc32c(bench_state* st)
+{
+	st->chk = Checksum(AAR_CHECKSUM_CRC32C, st->chk, (u8*) st->buf, st->len);
+}
+
+static void
+RunToDisk(bench_state* st)
+{
+	ToDisk(st->buf, sizeof(u64), st->len / sizeof(u64));
+}
+
+static void
+RunBase64Encode(bench_state* st)
+{
+	base64_encode(st->b64, st->buf, st->len);
+}
+
+static void
+RunBase64Decode(bench_state* st)
+{
+	(void) base64_decode(st->buf, st->b64, base64_encoded_size(st->len));
+}
+
+static bench_kernel kernels[] = {
+	{"EncryptBlocks",         RunEncrypt},
+	{"DecryptBlocks",         RunDecrypt},
+	{"EncryptBlocksParallel", RunEncryptParallel},
+	{"EncryptChecksum",       RunEncryptChecksum},
+	{"Checksum/bsd",          RunChecksumBsd},
+	{"Checksum/crc32c",       RunChecksumCrc32c},
+	{"ToDisk",                RunToDisk},
+	{"base64_encode",         RunBase64Encode},
+	{"base64_decode",         RunBase64Decode},
+};
+
+static double
+Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static u64
+Ticks(void)
+{
+#ifdef BENCH_HAS_TSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static const char*
+BackendName(bench_state* st)
+{
+#if defined AAR_CRYPT_AESNI && !defined _AAR_DEBUG_NOCRYPT
+	switch (st->cipher.level) {
+	case AESNI_VAES: return BENCH_BACKEND "-vaes";
+	case AESNI_SSE:  return BENCH_BACKEND "-sse";
+	case AESNI_NONE: return BENCH_BACKEND "-fallback";
+	}
+#endif
+	(void) st;
+	return BENCH_BACKEND;
+}
+
+int
+main(int argc, char** argv)
+{
+	static bench_state st;
+	size max = GigaBytes(1);
+	char* json_path = NULL;
+	file* json = NULL;
+	aes_key key;
+	bool first = true;
+
+	st.jobs = CpuCount();
+	ChecksumSetup();
+
+	for (int i = 1; i < argc; i++) {
+		string arg = $$(argv[i]);
+		if (HasPrefix$("--max=", arg)) {
+			max = strtoull(argv[i] + $("--max=").length, NULL, 10);
+		} else if (HasPrefix$("--jobs=", arg)) {
+			st.jobs = strtoull(argv[i] + $("--jobs=").length, NULL, 10);
+		} else if (HasPrefix$("--json=", arg)) {
+			json_path = argv[i] + $("--json=").length;
+		} else {
+			fprintf(stderr, "Usage: %s [--max=BYTES] [--jobs=N] [--json=FILE]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if (max < AAR_BLOCK_SIZE || st.jobs < 1) {
+		fprintf(stderr, "Invalid --max or --jobs.\n");
+		return 1;
+	}
+
+	st.buf = malloc(AAR_PADDING(max));
+	st.b64 = malloc(base64_encoded_size(max));
+	if (!st.buf || !st.b64) {
+		fprintf(stderr, "Failed to allocate %llu byte buffers.\n", max);
+		return 1;
+	}
+
+	// Touch every page up front so page faults aren't measured.
+	for (size i = 0; i < AAR_PADDING(max); i++) {
+		st.buf[i] = (byte) (i * 131 + 7);
+	}
+	base64_encode(st.b64, st.buf, max);
+
+	for (size i = 0; i < AAR_KEY_SIZE; i++) {
+		key.data[i] = (byte) i;
+	}
+	CipherInit(&st.cipher, key);
+
+	if (json_path) {
+		if (json = fopen(json_path, "w"), !json) {
+			fprintf(stderr, "Failed to open '%s'.\n", json_path);
+			return 1;
+		}
+		fprintf(json, "[\n");
+	}
+
+	printf("%-12s %-22s %12s %12s %10s\n", "backend", "kernel", "bytes", "MB/s", "cycles/B");
+
+	for (size k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+		for (size len = AAR_BLOCK_SIZE; len <= max; len *= 4) {
+			size calls = 1;
+			double elapsed;
+			u64 ticks;
+
+			st.len = len;
+			if (len < MegaBytes(1)) {
+				kernels[k].run(&st); // Warm up the caches
+			}
+
+			// Double the call count until the batch is long enough to time.
+			for (;;) {
+				double t0 = Now();
+				u64 c0 = Ticks();
+				for (size i = 0; i < calls; i++) {
+					kernels[k].run(&st);
+				}
+				ticks = Ticks() - c0;
+				elapsed = Now() - t0;
+				if (elapsed >= BENCH_MIN_SECONDS) {
+					break;
+				}
+				calls *= 2;
+			}
+
+			double bytes = (double) len * calls;
+			double mbps = bytes / elapsed / 1e6;
+			double cpb = ticks / bytes;
+
+			printf("%-12s %-22s %12llu %12.1f ", BackendName(&st), kernels[k].name, len, mbps);
+#ifdef BENCH_HAS_TSC
+			printf("%10.2f\n", cpb);
+#else
+			printf("%10s\n", "-");
+#endif
+
+			if (json) {
+				fprintf(json, "%s  {\"backend\": \"%s\", \"kernel\": \"%s\", \"jobs\": %llu, "
+					"\"bytes\": %llu, \"calls\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.3f, ",
+					first ? "" : ",\n", BackendName(&st), kernels[k].name, st.jobs,
+					len, calls, elapsed, mbps);
+#ifdef BENCH_HAS_TSC
+				fprintf(json, "\"cycles_per_byte\": %.3f}", cpb);
+#else
+				fprintf(json, "\"cycles_per_byte\": null}");
+#endif
+				first = false;
+			}
+
+			if (len > max / 4) {
+				break;
+			}
+		}
+	}
+
+	if (json) {
+		fprintf(json, "\n]\n");
+		fclose(json);
+	}
+
+	// Keep the checksum kernel from being optimized away.
+	if (st.chk == 0x5eed) {
+		printf("\n");
+	}
+
+	CipherWipe(&st.cipher);
+	free(st.buf);
+	free(st.b64);
+	return 0;
+}
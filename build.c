@@ -24,7 +24,7 @@
 
   The minimum requirements to build aar are:
 
-      cc -o aar -D AAR_OS_POSIX build.c
+      cc -o aar -D AAR_OS_POSIX build.c -lpthread
 
 
   Supported macro flags are,
@@ -32,21 +32,47 @@
   | MACRO FLAG         | DESCRIPTION                                    | 
   |--------------------+------------------------------------------------|
   | AAR_OS_POSIX       |  Build for a POSIX compliate platform.         |
-  | AAR_IOBUF          |  Buffer size for IO operations.                |
+  | AAR_IOBUF          |  Default cap on the IO buffer's size.          |
+  | AAR_ENGINE_SLICE   |  Smallest buffer slice given to a thread.      |
   | AAR_DEF_BZERO      |  Define macro for bzero instead of strings.h.  |
   | AAR_CRYPT_LIBTOM   |  Use libtomcrypt for AES insteadof aes256.     |
+  | AAR_CRYPT_AESNI    |  Use AES-NI/VAES, falling back to aes256.      |
+  | AAR_CRYPT_BITSLICE |  Use constant-time bitsliced AES.              |
+  | AAR_NO_CRC32C_HW   |  Don't use the SSE4.2 crc32 instruction.       |
+  | AAR_NO_MMAP        |  Always use stdio for encrypt and decrypt.     |
+  | AAR_NO_KERNEL_COPY |  Move and copy file data through the IO buffer. |
   | _AAR_DEBUG_NOCRYPT |  Don't encrypt and decrypt blocks.             |
+  | AAR_NO_MAIN        |  Leave out main() and mem, for bench and libaar. |
 */
 
 
 #ifdef AAR_OS_POSIX
 #     define _XOPEN_SOURCE 500
+#     ifdef __linux__
+#          define _GNU_SOURCE // fallocate(2) and copy_file_range(2)
+#     endif
 #endif
 
 // libc headers
 #include <stdio.h>
 #include <stdbool.h>
 
+#ifdef AAR_OS_POSIX
+#     include <pthread.h>
+#     include <fcntl.h>
+#     include <sys/mman.h>
+#     include <sys/stat.h>
+#     ifdef __linux__
+#          include <sys/ioctl.h>
+#          include <linux/fs.h> // FICLONERANGE
+#     endif
+#endif
+
+#if defined(__x86_64__) && !defined(AAR_NO_CRC32C_HW)
+#     include <cpuid.h>
+#     include <nmmintrin.h>
+#endif
+
 #ifdef AAR_DEF_BZERO
 #     define bzero(dest, len) memset((dest), 0, (len))
 #else
@@ -56,14 +82,17 @@
 // third party libs
 #include "libs/typeok.h"
 #include "libs/base64.h"
-#define NSTRINGS_MAIN
+#ifndef AAR_NO_MAIN
+#     define NSTRINGS_MAIN
+#endif
 #include "libs/nstrings.h"
 
 // aar application files
 #include "aar.h"
 
 #ifndef AAR_IOBUF
-// This should always be aligned with AAR_PADDING
+// Largest IO buffer unless --io-buffer says otherwise. This should
+// always be aligned with AAR_PADDING.
 #     define AAR_IOBUF AAR_PADDING(MegaBytes(100))
 #endif
 
@@ -75,6 +104,15 @@
 #    undef base64_encode
 #    undef base64_decode
 #    include "crypt_libtom.c"
+#elif defined AAR_CRYPT_AESNI
+#    define BACK_TO_TABLES // Fallback for CPUs without AES-NI
+#    include <cpuid.h>
+#    include <immintrin.h>
+#    include "contrib/aes256/aes256.h"
+#    include "contrib/aes256/aes256.c"
+#    include "crypt_aesni.c"
+#elif defined AAR_CRYPT_BITSLICE
+#    include "crypt_bitslice.c"
 #else
 #    define BACK_TO_TABLES // Use pre-calculated tables for AES
 #    include "contrib/aes256/aes256.h"
@@ -82,9 +120,13 @@
 #    include "crypt_aes256.c"
 #endif
 
+#include "checksum.c"
+
 #ifdef AAR_OS_POSIX
 #    include "os_posix.c"
 #endif
 
+#include "engine.c"
+
 #include "diskops.c"
 #include "main.c"
@@ -0,0 +1,225 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  Record checksums.
+
+  Archives without a format block use the legacy rotate-and-add
+  checksum. New archives use CRC32C, computed with the SSE4.2 crc32
+  instruction when the CPU has it and with slicing-by-8 tables
+  otherwise. Both produce the same values. Every kind starts from
+  AAR_CHECKSUM_INIT and can be fed a buffer in pieces. CRC32C sums of
+  adjacent pieces can also be computed separately and combined.
+*/
+
+#if defined(__x86_64__) && !defined(AAR_NO_CRC32C_HW)
+#    define CRC32C_HW
+#    define CRC32C_TARGET __attribute__((target("sse4.2")))
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // Castagnoli, reflected
+
+static u32 crc32c_table[8][256];
+static u32 crc32c_x2n[64]; // x^(2^n) mod P, for combining
+static bool crc32c_ready;
+static bool crc32c_hw;
+
+static aar_checksum
+ChecksumBsd(aar_checksum state, u8* buf, size buf_len)
+{
+	// 32-bit derivative of the BSD checksum.
+	for (size i = 0; i < buf_len; i++) {
+		state >>= 1;
+		state += (state & 1) << 31;
+		state += buf[i];
+	}
+	return state;
+}
+
+static aar_checksum
+Crc32cSoft(aar_checksum state, u8* buf, size buf_len)
+{
+	u32 crc = ~state;
+
+	for (; buf_len >= 8; buf += 8, buf_len -= 8) {
+		u32 lo = crc ^ (buf[0] | buf[1] << 8 | buf[2] << 16 | (u32) buf[3] << 24);
+		u32 hi = buf[4] | buf[5] << 8 | buf[6] << 16 | (u32) buf[7] << 24;
+
+		crc = crc32c_table[7][lo & 0xff]
+			^ crc32c_table[6][(lo >> 8) & 0xff]
+			^ crc32c_table[5][(lo >> 16) & 0xff]
+			^ crc32c_table[4][lo >> 24]
+			^ crc32c_table[3][hi & 0xff]
+			^ crc32c_table[2][(hi >> 8) & 0xff]
+			^ crc32c_table[1][(hi >> 16) & 0xff]
+			^ crc32c_table[0][hi >> 24];
+	}
+
+	while (buf_len--) {
+		crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+
+	return ~crc;
+}
+
+// Multiply a and b modulo the CRC32C polynomial.
+static u32
+Crc32cMultiply(u32 a, u32 b)
+{
+	u32 m = (u32) 1 << 31;
+	u32 p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if ((a & (m - 1)) == 0) {
+				break;
+			}
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+#ifdef CRC32C_HW
+CRC32C_TARGET static aar_checksum
+Crc32cHw(aar_checksum state, u8* buf, size buf_len)
+{
+	u64 crc = (u32) ~state;
+
+	for (; buf_len > 0 && ((uintptr_t) buf & 7); buf_len--) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+
+	for (; buf_len >= 8; buf += 8, buf_len -= 8) {
+		u64 word;
+		memcpy(&word, buf, sizeof(word));
+		crc = _mm_crc32_u64(crc, word);
+	}
+
+	while (buf_len--) {
+		crc = _mm_crc32_u8(crc, *buf++);
+	}
+
+	return ~(u32) crc;
+}
+#endif
+
+/*
+  Build the software tables and pick the CRC32C implementation. Call
+  this before starting threads that compute checksums.
+*/
+void
+ChecksumSetup(void)
+{
+	if (crc32c_ready) {
+		return;
+	}
+
+	for (u32 i = 0; i < 256; i++) {
+		u32 crc = i;
+		for (int k = 0; k < 8; k++) {
+			crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+		}
+		crc32c_table[0][i] = crc;
+	}
+
+	crc32c_x2n[0] = (u32) 1 << 30; // x^1
+	for (int n = 1; n < 64; n++) {
+		crc32c_x2n[n] = Crc32cMultiply(crc32c_x2n[n - 1], crc32c_x2n[n - 1]);
+	}
+
+	for (u32 i = 0; i < 256; i++) {
+		for (int t = 1; t < 8; t++) {
+			u32 prev = crc32c_table[t - 1][i];
+			crc32c_table[t][i] = crc32c_table[0][prev & 0xff] ^ (prev >> 8);
+		}
+	}
+
+#ifdef CRC32C_HW
+	unsigned int eax, ebx, ecx, edx;
+	crc32c_hw = __get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & bit_SSE4_2);
+#endif
+
+	crc32c_ready = true;
+}
+
+aar_checksum
+Checksum(aar_checksum_kind kind, aar_checksum state, u8* buf, size buf_len)
+{
+	switch (kind) {
+	case AAR_CHECKSUM_CRC32C:
+		ChecksumSetup();
+#ifdef CRC32C_HW
+		if (crc32c_hw) {
+			return Crc32cHw(state, buf, buf_len);
+		}
+#endif
+		return Crc32cSoft(state, buf, buf_len);
+	case AAR_CHECKSUM_BSD:
+	default:
+		return ChecksumBsd(state, buf, buf_len);
+	}
+}
+
+/* True if ChecksumCombine() works for kind. */
+bool
+ChecksumCombinable(aar_checksum_kind kind)
+{
+	return kind == AAR_CHECKSUM_CRC32C;
+}
+
+/*
+  Return the checksum of A followed by B, given the checksum a of A,
+  the checksum b of B and the byte length of B. Both must have been
+  started from AAR_CHECKSUM_INIT. Only for combinable kinds.
+*/
+aar_checksum
+ChecksumCombine(aar_checksum_kind kind, aar_checksum a, aar_checksum b, size b_len)
+{
+	u32 shift = (u32) 1 << 31; // x^0
+
+	assert(ChecksumCombinable(kind));
+	ChecksumSetup();
+
+	// Multiply a by x^(8 * b_len), one power of two at a time.
+	for (int n = 3; b_len > 0; b_len >>= 1, n++) {
+		if (b_len & 1) {
+			shift = Crc32cMultiply(crc32c_x2n[n & 63], shift);
+		}
+	}
+
+	return Crc32cMultiply(shift, a) ^ b;
+}
+
+/* Return the checksum kind called name, or ok = 0 if there's none. */
+aar_checksum_kind_ok
+ChecksumKind(string name)
+{
+	aar_checksum_kind_ok result = {0};
+
+	if (Equals$("crc32c", name)) {
+		result.value = AAR_CHECKSUM_CRC32C;
+		result.ok = 1;
+	} else if (Equals$("bsd", name)) {
+		result.value = AAR_CHECKSUM_BSD;
+		result.ok = 1;
+	}
+
+	return result;
+}
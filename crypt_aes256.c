@@ -14,34 +14,49 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+typedef struct {
+	aes256_context_t ctx;
+} aar_cipher;
+
 void
-EncryptBlocks(void* _dest, size nblocks, aes_key key)
+CipherInit(aar_cipher* cipher, aes_key key)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	aes256_init(&cipher->ctx, (aes256_key_t*) &key);
+#endif
+}
+
+void
+CipherWipe(aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	aes256_done(&cipher->ctx);
+#endif
+	bzero(cipher, sizeof(*cipher));
+}
+
+void
+EncryptBlocks(void* _dest, size nblocks, aar_cipher* cipher)
 {
 #ifndef _AAR_DEBUG_NOCRYPT
-	aes256_context_t ctx;
 	byte* dest = _dest;
-	aes256_init(&ctx, (aes256_key_t*) &key);
 	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
 		for (size i = 0; i < nblocks; i++) {
-			aes256_encrypt_ecb(&ctx, ((aes256_blk_t*) dest) + i);
+			aes256_encrypt_ecb(&cipher->ctx, ((aes256_blk_t*) dest) + i);
 		}
 	}
-	aes256_done(&ctx);
 #endif
 }
 
 void
-DecryptBlocks(void* _dest, size nblocks, aes_key key)
+DecryptBlocks(void* _dest, size nblocks, aar_cipher* cipher)
 {
 #ifndef _AAR_DEBUG_NOCRYPT
-	aes256_context_t ctx;
 	byte* dest = _dest;
-	aes256_init(&ctx, (aes256_key_t*) &key);
 	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
 		for (size i = 0; i < nblocks; i++) {
-			aes256_decrypt_ecb(&ctx, ((aes256_blk_t*) dest) + i);
+			aes256_decrypt_ecb(&cipher->ctx, ((aes256_blk_t*) dest) + i);
 		}
 	}
-	aes256_done(&ctx);
 #endif
 }
@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  AES-NI backend for x86.
+
+  ECB blocks don't depend on each other, so we keep eight of them in
+  flight per round to hide the latency of aesenc/aesdec. If the CPU
+  has VAES, two blocks share a 256 bit register. The fastest path is
+  picked with CPUID when the cipher is initialized. CPUs without
+  AES-NI fall back to the table driven contrib/aes256.
+*/
+
+#if !defined(__x86_64__) && !defined(__i386__)
+#    error "AAR_CRYPT_AESNI requires an x86 CPU."
+#endif
+
+#define AESNI_ROUNDS 14
+#define AESNI_LANES  8 // Blocks processed per iteration
+
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+#define VAES_TARGET  __attribute__((target("aes,sse2,avx2,vaes")))
+
+typedef enum {
+	AESNI_NONE,    // No AES-NI, use contrib/aes256
+	AESNI_SSE,     // AES-NI with 128 bit registers
+	AESNI_VAES,    // AES-NI with 256 bit registers
+} aesni_level;
+
+typedef struct {
+	__m128i enc[AESNI_ROUNDS + 1];
+	__m128i dec[AESNI_ROUNDS + 1];
+} aesni_schedule;
+
+typedef struct {
+	aesni_level level;
+	aesni_schedule ks;     // Used when level != AESNI_NONE
+	aes256_context_t ctx;  // Used when level == AESNI_NONE
+} aar_cipher;
+
+static aesni_level
+AesniProbe(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+	unsigned int xcr0_lo, xcr0_hi;
+	int has_aes, has_osxsave;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return AESNI_NONE;
+	}
+
+	has_aes = (ecx & bit_AES) != 0;
+	has_osxsave = (ecx & bit_OSXSAVE) != 0;
+
+	if (!has_aes) {
+		return AESNI_NONE;
+	}
+
+	// VAES needs the OS to save the upper halves of the ymm registers.
+	if (!has_osxsave || !__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+		return AESNI_SSE;
+	}
+
+	__asm__ ("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+	(void) xcr0_hi;
+
+	if ((xcr0_lo & 6) == 6 && (ebx & bit_AVX2) && (ecx & (1 << 9))) {
+		return AESNI_VAES;
+	}
+
+	return AESNI_SSE;
+}
+
+AESNI_TARGET static __m128i
+AesniExpandEven(__m128i k, __m128i assist)
+{
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, assist);
+}
+
+AESNI_TARGET static __m128i
+AesniExpandOdd(__m128i k, __m128i prev)
+{
+	__m128i assist = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0), 0xaa);
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+	return _mm_xor_si128(k, assist);
+}
+
+AESNI_TARGET static void
+AesniExpandKey(aesni_schedule* ks, aes_key* key)
+{
+	__m128i* rk = ks->enc;
+
+	rk[0] = _mm_loadu_si128((__m128i*) key->data);
+	rk[1] = _mm_loadu_si128((__m128i*) (key->data + AAR_BLOCK_SIZE));
+
+	// _mm_aeskeygenassist_si128 needs the round constant as an immediate.
+#define AESNI_EXPAND(i, rcon)						\
+	rk[i] = AesniExpandEven(rk[(i) - 2], _mm_aeskeygenassist_si128(rk[(i) - 1], rcon)); \
+	if ((i) < AESNI_ROUNDS) {					\
+		rk[(i) + 1] = AesniExpandOdd(rk[(i) - 1], rk[i]);	\
+	}
+	AESNI_EXPAND(2,  0x01);
+	AESNI_EXPAND(4,  0x02);
+	AESNI_EXPAND(6,  0x04);
+	AESNI_EXPAND(8,  0x08);
+	AESNI_EXPAND(10, 0x10);
+	AESNI_EXPAND(12, 0x20);
+	AESNI_EXPAND(14, 0x40);
+#undef AESNI_EXPAND
+
+	// Equivalent inverse cipher round keys
+	ks->dec[0] = ks->enc[AESNI_ROUNDS];
+	for (int i = 1; i < AESNI_ROUNDS; i++) {
+		ks->dec[i] = _mm_aesimc_si128(ks->enc[AESNI_ROUNDS - i]);
+	}
+	ks->dec[AESNI_ROUNDS] = ks->enc[0];
+}
+
+AESNI_TARGET static void
+AesniEncrypt(aesni_schedule* ks, byte* dest, size nblocks)
+{
+	__m128i* rk = ks->enc;
+	__m128i b[AESNI_LANES];
+	size i = 0;
+
+	for (; i + AESNI_LANES <= nblocks; i += AESNI_LANES) {
+		__m128i* p = (__m128i*) (dest + i * AAR_BLOCK_SIZE);
+
+		for (int j = 0; j < AESNI_LANES; j++) {
+			b[j] = _mm_xor_si128(_mm_loadu_si128(p + j), rk[0]);
+		}
+		for (int r = 1; r < AESNI_ROUNDS; r++) {
+			for (int j = 0; j < AESNI_LANES; j++) {
+				b[j] = _mm_aesenc_si128(b[j], rk[r]);
+			}
+		}
+		for (int j = 0; j < AESNI_LANES; j++) {
+			_mm_storeu_si128(p + j, _mm_aesenclast_si128(b[j], rk[AESNI_ROUNDS]));
+		}
+	}
+
+	for (; i < nblocks; i++) {
+		__m128i* p = (__m128i*) (dest + i * AAR_BLOCK_SIZE);
+
+		b[0] = _mm_xor_si128(_mm_loadu_si128(p), rk[0]);
+		for (int r = 1; r < AESNI_ROUNDS; r++) {
+			b[0] = _mm_aesenc_si128(b[0], rk[r]);
+		}
+		_mm_storeu_si128(p, _mm_aesenclast_si128(b[0], rk[AESNI_ROUNDS]));
+	}
+}
+
+AESNI_TARGET static void
+AesniDecrypt(aesni_schedule* ks, byte* dest, size nblocks)
+{
+	__m128i* rk = ks->dec;
+	__m128i b[AESNI_LANES];
+	size i = 0;
+
+	for (; i + AESNI_LANES <= nblocks; i += AESNI_LANES) {
+		__m128i* p = (__m128i*) (dest + i * AAR_BLOCK_SIZE);
+
+		for (int j = 0; j < AESNI_LANES; j++) {
+			b[j] = _mm_xor_si128(_mm_loadu_si128(p + j), rk[0]);
+		}
+		for (int r = 1; r < AESNI_ROUNDS; r++) {
+			for (int j = 0; j < AESNI_LANES; j++) {
+				b[j] = _mm_aesdec_si128(b[j], rk[r]);
+			}
+		}
+		for (int j = 0; j < AESNI_LANES; j++) {
+			_mm_storeu_si128(p + j, _mm_aesdeclast_si128(b[j], rk[AESNI_ROUNDS]));
+		}
+	}
+
+	for (; i < nblocks; i++) {
+		__m128i* p = (__m128i*) (dest + i * AAR_BLOCK_SIZE);
+
+		b[0] = _mm_xor_si128(_mm_loadu_si128(p), rk[0]);
+		for (int r = 1; r < AESNI_ROUNDS; r++) {
+			b[0] = _mm_aesdec_si128(b[0], rk[r]);
+		}
+		_mm_storeu_si128(p, _mm_aesdeclast_si128(b[0], rk[AESNI_ROUNDS]));
+	}
+}
+
+/*
+  VAES variants. Each ymm register carries two blocks, so four
+  registers cover AESNI_LANES blocks. Leftovers go through the 128 bit
+  code.
+*/
+VAES_TARGET static void
+VaesEncrypt(aesni_schedule* ks, byte* dest, size nblocks)
+{
+	__m256i rk[AESNI_ROUNDS + 1];
+	__m256i b[AESNI_LANES / 2];
+	size i = 0;
+
+	for (int r = 0; r <= AESNI_ROUNDS; r++) {
+		rk[r] = _mm256_broadcastsi128_si256(ks->enc[r]);
+	}
+
+	for (; i + AESNI_LANES <= nblocks; i += AESNI_LANES) {
+		__m256i* p = (__m256i*) (dest + i * AAR_BLOCK_SIZE);
+
+		for (int j = 0; j < AESNI_LANES / 2; j++) {
+			b[j] = _mm256_xor_si256(_mm256_loadu_si256(p + j), rk[0]);
+		}
+		for (int r = 1; r < AESNI_ROUNDS; r++) {
+			for (int j = 0; j < AESNI_LANES / 2; j++) {
+				b[j] = _mm256_aesenc_epi128(b[j], rk[r]);
+			}
+		}
+		for (int j = 0; j < AESNI_LANES / 2; j++) {
+			_mm256_storeu_si256(p + j, _mm256_aesenclast_epi128(b[j], rk[AESNI_ROUNDS]));
+		}
+	}
+
+	AesniEncrypt(ks, dest + i * AAR_BLOCK_SIZE, nblocks - i);
+}
+
+VAES_TARGET static void
+VaesDecrypt(aesni_schedule* ks, byte* dest, size nblocks)
+{
+	__m256i rk[AESNI_ROUNDS + 1];
+	__m256i b[AESNI_LANES / 2];
+	size i = 0;
+
+	for (int r = 0; r <= AESNI_ROUNDS; r++) {
+		rk[r] = _mm256_broadcastsi128_si256(ks->dec[r]);
+	}
+
+	for (; i + AESNI_LANES <= nblocks; i += AESNI_LANES) {
+		__m256i* p = (__m256i*) (dest + i * AAR_BLOCK_SIZE);
+
+		for (int j = 0; j < AESNI_LANES / 2; j++) {
+			b[j] = _mm256_xor_si256(_mm256_loadu_si256(p + j), rk[0]);
+		}
+		for (int r = 1; r < AESNI_ROUNDS; r++) {
+			for (int j = 0; j < AESNI_LANES / 2; j++) {
+				b[j] = _mm256_aesdec_epi128(b[j], rk[r]);
+			}
+		}
+		for (int j = 0; j < AESNI_LANES / 2; j++) {
+			_mm256_storeu_si256(p + j, _mm256_aesdeclast_epi128(b[j], rk[AESNI_ROUNDS]));
+		}
+	}
+
+	AesniDecrypt(ks, dest + i * AAR_BLOCK_SIZE, nblocks - i);
+}
+
+void
+CipherInit(aar_cipher* cipher, aes_key key)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	cipher->level = AesniProbe();
+	if (cipher->level == AESNI_NONE) {
+		aes256_init(&cipher->ctx, (aes256_key_t*) &key);
+	} else {
+		AesniExpandKey(&cipher->ks, &key);
+	}
+#endif
+}
+
+void
+CipherWipe(aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	if (cipher->level == AESNI_NONE) {
+		aes256_done(&cipher->ctx);
+	}
+#endif
+	bzero(cipher, sizeof(*cipher));
+}
+
+void
+EncryptBlocks(void* _dest, size nblocks, aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	byte* dest = _dest;
+	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
+		switch (cipher->level) {
+		case AESNI_VAES:
+			VaesEncrypt(&cipher->ks, dest, nblocks);
+			break;
+		case AESNI_SSE:
+			AesniEncrypt(&cipher->ks, dest, nblocks);
+			break;
+		case AESNI_NONE:
+			for (size i = 0; i < nblocks; i++) {
+				aes256_encrypt_ecb(&cipher->ctx, ((aes256_blk_t*) dest) + i);
+			}
+			break;
+		}
+	}
+#endif
+}
+
+void
+DecryptBlocks(void* _dest, size nblocks, aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	byte* dest = _dest;
+	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
+		switch (cipher->level) {
+		case AESNI_VAES:
+			VaesDecrypt(&cipher->ks, dest, nblocks);
+			break;
+		case AESNI_SSE:
+			AesniDecrypt(&cipher->ks, dest, nblocks);
+			break;
+		case AESNI_NONE:
+			for (size i = 0; i < nblocks; i++) {
+				aes256_decrypt_ecb(&cipher->ctx, ((aes256_blk_t*) dest) + i);
+			}
+			break;
+		}
+	}
+#endif
+}
@@ -0,0 +1,579 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  Constant-time bitsliced AES-256.
+
+  The state of four blocks is spread over eight 64 bit words so that
+  word i holds bit i of every byte. SubBytes is then a fixed circuit of
+  boolean operations (Boyar and Peralta's S-box), and ShiftRows and
+  MixColumns become shifts and rotations. There are no secret
+  dependent table lookups or branches, so the cipher has no cache
+  timing variance. This layout follows Thomas Pornin's aes_ct64 from
+  BearSSL.
+
+  ECB blocks are independent, so BitsliceEncrypt() walks the buffer
+  eight blocks at a time as two interleaved four-block states. A short
+  tail is zero padded into a scratch state.
+*/
+
+#define BITSLICE_ROUNDS 14
+#define BITSLICE_LANES  8 // Blocks processed per iteration
+
+typedef struct {
+	u64 sk[(BITSLICE_ROUNDS + 1) * 8]; // Bitsliced round keys
+} aar_cipher;
+
+static void
+BitsliceSbox(u64* q)
+{
+	/*
+	  Boyar and Peralta's S-box circuit: a top linear transform,
+	  a shared non-linear core computing the GF(2^8) inverse, and a
+	  bottom linear transform that includes the affine map.
+	*/
+	u64 x0, x1, x2, x3, x4, x5, x6, x7;
+	u64 y1, y2, y3, y4, y5, y6, y7, y8, y9;
+	u64 y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+	u64 y20, y21;
+	u64 z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+	u64 z10, z11, z12, z13, z14, z15, z16, z17;
+	u64 t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	u64 t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	u64 t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+	u64 t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	u64 t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+	u64 t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	u64 t60, t61, t62, t63, t64, t65, t66, t67;
+	u64 s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7];
+	x1 = q[6];
+	x2 = q[5];
+	x3 = q[4];
+	x4 = q[3];
+	x5 = q[2];
+	x6 = q[1];
+	x7 = q[0];
+
+	// Top linear transformation
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+
+	// Non-linear section
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+
+	// Bottom linear transformation
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+
+	q[7] = s0;
+	q[6] = s1;
+	q[5] = s2;
+	q[4] = s3;
+	q[3] = s4;
+	q[2] = s5;
+	q[1] = s6;
+	q[0] = s7;
+}
+
+/*
+  The inverse S-box reuses the forward circuit. S(x) = A(x^-1) + c,
+  so A^-1(S(A^-1(y + c)) + c) = (A^-1(y + c))^-1 = S^-1(y).
+*/
+static void
+BitsliceAffineInverse(u64* q)
+{
+	u64 q0 = ~q[0], q1 = ~q[1], q2 = q[2], q3 = q[3];
+	u64 q4 = q[4], q5 = ~q[5], q6 = ~q[6], q7 = q[7];
+
+	q[7] = q1 ^ q4 ^ q6;
+	q[6] = q0 ^ q3 ^ q5;
+	q[5] = q7 ^ q2 ^ q4;
+	q[4] = q6 ^ q1 ^ q3;
+	q[3] = q5 ^ q0 ^ q2;
+	q[2] = q4 ^ q7 ^ q1;
+	q[1] = q3 ^ q6 ^ q0;
+	q[0] = q2 ^ q5 ^ q7;
+}
+
+static void
+BitsliceInvSbox(u64* q)
+{
+	BitsliceAffineInverse(q);
+	BitsliceSbox(q);
+	BitsliceAffineInverse(q);
+}
+
+#define BITSLICE_SWAP(cl, ch, s, x, y) do {				\
+		u64 a = (x), b = (y);					\
+		(x) = (a & (u64) (cl)) | ((b & (u64) (cl)) << (s));	\
+		(y) = ((a & (u64) (ch)) >> (s)) | (b & (u64) (ch));	\
+	} while (0)
+
+#define BITSLICE_SWAP2(x, y) BITSLICE_SWAP(0x5555555555555555, 0xAAAAAAAAAAAAAAAA, 1, x, y)
+#define BITSLICE_SWAP4(x, y) BITSLICE_SWAP(0x3333333333333333, 0xCCCCCCCCCCCCCCCC, 2, x, y)
+#define BITSLICE_SWAP8(x, y) BITSLICE_SWAP(0x0F0F0F0F0F0F0F0F, 0xF0F0F0F0F0F0F0F0, 4, x, y)
+
+/* Transpose between byte lanes and bit planes. It is its own inverse. */
+static void
+BitsliceOrtho(u64* q)
+{
+	BITSLICE_SWAP2(q[0], q[1]);
+	BITSLICE_SWAP2(q[2], q[3]);
+	BITSLICE_SWAP2(q[4], q[5]);
+	BITSLICE_SWAP2(q[6], q[7]);
+
+	BITSLICE_SWAP4(q[0], q[2]);
+	BITSLICE_SWAP4(q[1], q[3]);
+	BITSLICE_SWAP4(q[4], q[6]);
+	BITSLICE_SWAP4(q[5], q[7]);
+
+	BITSLICE_SWAP8(q[0], q[4]);
+	BITSLICE_SWAP8(q[1], q[5]);
+	BITSLICE_SWAP8(q[2], q[6]);
+	BITSLICE_SWAP8(q[3], q[7]);
+}
+
+static u32
+BitsliceLoad32(const u8* p)
+{
+	return (u32) p[0] | ((u32) p[1] << 8) | ((u32) p[2] << 16) | ((u32) p[3] << 24);
+}
+
+static void
+BitsliceStore32(u8* p, u32 x)
+{
+	p[0] = x;
+	p[1] = x >> 8;
+	p[2] = x >> 16;
+	p[3] = x >> 24;
+}
+
+/* Spread one 16 byte block over two words, one byte every 16 bits. */
+static void
+BitsliceInterleaveIn(u64* q0, u64* q1, const u8* blk)
+{
+	u64 x[4];
+
+	for (int i = 0; i < 4; i++) {
+		x[i] = BitsliceLoad32(blk + 4 * i);
+		x[i] |= x[i] << 16;
+		x[i] &= 0x0000FFFF0000FFFF;
+		x[i] |= x[i] << 8;
+		x[i] &= 0x00FF00FF00FF00FF;
+	}
+
+	*q0 = x[0] | (x[2] << 8);
+	*q1 = x[1] | (x[3] << 8);
+}
+
+static void
+BitsliceInterleaveOut(u8* blk, u64 q0, u64 q1)
+{
+	u64 x[4];
+
+	x[0] = q0 & 0x00FF00FF00FF00FF;
+	x[1] = q1 & 0x00FF00FF00FF00FF;
+	x[2] = (q0 >> 8) & 0x00FF00FF00FF00FF;
+	x[3] = (q1 >> 8) & 0x00FF00FF00FF00FF;
+
+	for (int i = 0; i < 4; i++) {
+		x[i] |= x[i] >> 8;
+		x[i] &= 0x0000FFFF0000FFFF;
+		BitsliceStore32(blk + 4 * i, (u32) x[i] | (u32) (x[i] >> 16));
+	}
+}
+
+/* Load four consecutive blocks into bitsliced form. */
+static void
+BitsliceLoad(u64* q, const u8* blocks)
+{
+	for (int i = 0; i < 4; i++) {
+		BitsliceInterleaveIn(&q[i], &q[i + 4], blocks + i * AAR_BLOCK_SIZE);
+	}
+	BitsliceOrtho(q);
+}
+
+static void
+BitsliceStore(u8* blocks, u64* q)
+{
+	BitsliceOrtho(q);
+	for (int i = 0; i < 4; i++) {
+		BitsliceInterleaveOut(blocks + i * AAR_BLOCK_SIZE, q[i], q[i + 4]);
+	}
+}
+
+static void
+BitsliceAddRoundKey(u64* q, const u64* sk)
+{
+	for (int i = 0; i < 8; i++) {
+		q[i] ^= sk[i];
+	}
+}
+
+static void
+BitsliceShiftRows(u64* q)
+{
+	for (int i = 0; i < 8; i++) {
+		u64 x = q[i];
+		q[i] = (x & 0x000000000000FFFF)
+			| ((x & 0x00000000FFF00000) >> 4)
+			| ((x & 0x00000000000F0000) << 12)
+			| ((x & 0x0000FF0000000000) >> 8)
+			| ((x & 0x000000FF00000000) << 8)
+			| ((x & 0xF000000000000000) >> 12)
+			| ((x & 0x0FFF000000000000) << 4);
+	}
+}
+
+static void
+BitsliceInvShiftRows(u64* q)
+{
+	for (int i = 0; i < 8; i++) {
+		u64 x = q[i];
+		q[i] = (x & 0x000000000000FFFF)
+			| ((x & 0x000000000FFF0000) << 4)
+			| ((x & 0x00000000F0000000) >> 12)
+			| ((x & 0x000000FF00000000) << 8)
+			| ((x & 0x0000FF0000000000) >> 8)
+			| ((x & 0x000F000000000000) << 12)
+			| ((x & 0xFFF0000000000000) >> 4);
+	}
+}
+
+static u64
+BitsliceRotr32(u64 x)
+{
+	return (x << 32) | (x >> 32);
+}
+
+static void
+BitsliceMixColumns(u64* q)
+{
+	u64 q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+	u64 q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+	u64 r0 = (q0 >> 16) | (q0 << 48);
+	u64 r1 = (q1 >> 16) | (q1 << 48);
+	u64 r2 = (q2 >> 16) | (q2 << 48);
+	u64 r3 = (q3 >> 16) | (q3 << 48);
+	u64 r4 = (q4 >> 16) | (q4 << 48);
+	u64 r5 = (q5 >> 16) | (q5 << 48);
+	u64 r6 = (q6 >> 16) | (q6 << 48);
+	u64 r7 = (q7 >> 16) | (q7 << 48);
+
+	q[0] = q7 ^ r7 ^ r0 ^ BitsliceRotr32(q0 ^ r0);
+	q[1] = q0 ^ r0 ^ q7 ^ r7 ^ r1 ^ BitsliceRotr32(q1 ^ r1);
+	q[2] = q1 ^ r1 ^ r2 ^ BitsliceRotr32(q2 ^ r2);
+	q[3] = q2 ^ r2 ^ q7 ^ r7 ^ r3 ^ BitsliceRotr32(q3 ^ r3);
+	q[4] = q3 ^ r3 ^ q7 ^ r7 ^ r4 ^ BitsliceRotr32(q4 ^ r4);
+	q[5] = q4 ^ r4 ^ r5 ^ BitsliceRotr32(q5 ^ r5);
+	q[6] = q5 ^ r5 ^ r6 ^ BitsliceRotr32(q6 ^ r6);
+	q[7] = q6 ^ r6 ^ r7 ^ BitsliceRotr32(q7 ^ r7);
+}
+
+static void
+BitsliceInvMixColumns(u64* q)
+{
+	u64 q0 = q[0], q1 = q[1], q2 = q[2], q3 = q[3];
+	u64 q4 = q[4], q5 = q[5], q6 = q[6], q7 = q[7];
+	u64 r0 = (q0 >> 16) | (q0 << 48);
+	u64 r1 = (q1 >> 16) | (q1 << 48);
+	u64 r2 = (q2 >> 16) | (q2 << 48);
+	u64 r3 = (q3 >> 16) | (q3 << 48);
+	u64 r4 = (q4 >> 16) | (q4 << 48);
+	u64 r5 = (q5 >> 16) | (q5 << 48);
+	u64 r6 = (q6 >> 16) | (q6 << 48);
+	u64 r7 = (q7 >> 16) | (q7 << 48);
+
+	q[0] = q5 ^ q6 ^ q7 ^ r0 ^ r5 ^ r7 ^ BitsliceRotr32(q0 ^ q5 ^ q6 ^ r0 ^ r5);
+	q[1] = q0 ^ q5 ^ r0 ^ r1 ^ r5 ^ r6 ^ r7 ^ BitsliceRotr32(q1 ^ q5 ^ q7 ^ r1 ^ r5 ^ r6);
+	q[2] = q0 ^ q1 ^ q6 ^ r1 ^ r2 ^ r6 ^ r7 ^ BitsliceRotr32(q0 ^ q2 ^ q6 ^ r2 ^ r6 ^ r7);
+	q[3] = q0 ^ q1 ^ q2 ^ q5 ^ q6 ^ r0 ^ r2 ^ r3 ^ r5
+		^ BitsliceRotr32(q0 ^ q1 ^ q3 ^ q5 ^ q6 ^ q7 ^ r0 ^ r3 ^ r5 ^ r7);
+	q[4] = q1 ^ q2 ^ q3 ^ q5 ^ r1 ^ r3 ^ r4 ^ r5 ^ r6 ^ r7
+		^ BitsliceRotr32(q1 ^ q2 ^ q4 ^ q5 ^ q7 ^ r1 ^ r4 ^ r5 ^ r6);
+	q[5] = q2 ^ q3 ^ q4 ^ q6 ^ r2 ^ r4 ^ r5 ^ r6 ^ r7
+		^ BitsliceRotr32(q2 ^ q3 ^ q5 ^ q6 ^ r2 ^ r5 ^ r6 ^ r7);
+	q[6] = q3 ^ q4 ^ q5 ^ q7 ^ r3 ^ r5 ^ r6 ^ r7
+		^ BitsliceRotr32(q3 ^ q4 ^ q6 ^ q7 ^ r3 ^ r6 ^ r7);
+	q[7] = q4 ^ q5 ^ q6 ^ r4 ^ r6 ^ r7
+		^ BitsliceRotr32(q4 ^ q5 ^ q7 ^ r4 ^ r7);
+}
+
+/* SubWord() for the key schedule, run through the same circuit. */
+static u32
+BitsliceSubWord(u32 x)
+{
+	u64 q[8] = {0};
+
+	q[0] = x;
+	BitsliceOrtho(q);
+	BitsliceSbox(q);
+	BitsliceOrtho(q);
+	return (u32) q[0];
+}
+
+static void
+BitsliceEncryptState(aar_cipher* cipher, u64* q)
+{
+	u64* sk = cipher->sk;
+
+	BitsliceAddRoundKey(q, sk);
+	for (int r = 1; r < BITSLICE_ROUNDS; r++) {
+		BitsliceSbox(q);
+		BitsliceShiftRows(q);
+		BitsliceMixColumns(q);
+		BitsliceAddRoundKey(q, sk + 8 * r);
+	}
+	BitsliceSbox(q);
+	BitsliceShiftRows(q);
+	BitsliceAddRoundKey(q, sk + 8 * BITSLICE_ROUNDS);
+}
+
+static void
+BitsliceDecryptState(aar_cipher* cipher, u64* q)
+{
+	u64* sk = cipher->sk;
+
+	BitsliceAddRoundKey(q, sk + 8 * BITSLICE_ROUNDS);
+	for (int r = BITSLICE_ROUNDS - 1; r > 0; r--) {
+		BitsliceInvShiftRows(q);
+		BitsliceInvSbox(q);
+		BitsliceAddRoundKey(q, sk + 8 * r);
+		BitsliceInvMixColumns(q);
+	}
+	BitsliceInvShiftRows(q);
+	BitsliceInvSbox(q);
+	BitsliceAddRoundKey(q, sk);
+}
+
+static void
+BitsliceRun(aar_cipher* cipher, u8* dest, size nblocks, bool decrypt)
+{
+	u64 q[2][8];
+	u8 tail[BITSLICE_LANES * AAR_BLOCK_SIZE];
+
+	while (nblocks > 0) {
+		size n = nblocks < BITSLICE_LANES ? nblocks : BITSLICE_LANES;
+		u8* p = dest;
+
+		if (n < BITSLICE_LANES) {
+			bzero(tail, sizeof(tail));
+			memcpy(tail, dest, n * AAR_BLOCK_SIZE);
+			p = tail;
+		}
+
+		BitsliceLoad(q[0], p);
+		BitsliceLoad(q[1], p + 4 * AAR_BLOCK_SIZE);
+		if (decrypt) {
+			BitsliceDecryptState(cipher, q[0]);
+			BitsliceDecryptState(cipher, q[1]);
+		} else {
+			BitsliceEncryptState(cipher, q[0]);
+			BitsliceEncryptState(cipher, q[1]);
+		}
+		BitsliceStore(p, q[0]);
+		BitsliceStore(p + 4 * AAR_BLOCK_SIZE, q[1]);
+
+		if (p == tail) {
+			memcpy(dest, tail, n * AAR_BLOCK_SIZE);
+		}
+
+		dest += n * AAR_BLOCK_SIZE;
+		nblocks -= n;
+	}
+
+	bzero(q, sizeof(q));
+	bzero(tail, sizeof(tail));
+}
+
+void
+CipherInit(aar_cipher* cipher, aes_key key)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	u32 w[4 * (BITSLICE_ROUNDS + 1)];
+	u32 rcon = 1;
+	const int nk = AAR_KEY_SIZE / 4;
+
+	// Standard key expansion on little endian words
+	for (int i = 0; i < nk; i++) {
+		w[i] = BitsliceLoad32((u8*) key.data + 4 * i);
+	}
+	for (int i = nk; i < 4 * (BITSLICE_ROUNDS + 1); i++) {
+		u32 t = w[i - 1];
+		if (i % nk == 0) {
+			t = BitsliceSubWord((t >> 8) | (t << 24)) ^ rcon;
+			rcon = (rcon << 1) ^ (0x11b & -(rcon >> 7));
+		} else if (i % nk == 4) {
+			t = BitsliceSubWord(t);
+		}
+		w[i] = w[i - nk] ^ t;
+	}
+
+	// Each round key is loaded into all four block lanes.
+	for (int r = 0; r <= BITSLICE_ROUNDS; r++) {
+		u8 rk[4 * AAR_BLOCK_SIZE];
+		for (int lane = 0; lane < 4; lane++) {
+			for (int i = 0; i < 4; i++) {
+				BitsliceStore32(rk + lane * AAR_BLOCK_SIZE + 4 * i, w[4 * r + i]);
+			}
+		}
+		BitsliceLoad(cipher->sk + 8 * r, rk);
+		bzero(rk, sizeof(rk));
+	}
+
+	bzero(w, sizeof(w));
+#endif
+}
+
+void
+CipherWipe(aar_cipher* cipher)
+{
+	bzero(cipher, sizeof(*cipher));
+}
+
+void
+EncryptBlocks(void* dest, size nblocks, aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
+		BitsliceRun(cipher, dest, nblocks, false);
+	}
+#endif
+}
+
+void
+DecryptBlocks(void* dest, size nblocks, aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
+		BitsliceRun(cipher, dest, nblocks, true);
+	}
+#endif
+}
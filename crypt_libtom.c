@@ -15,36 +15,51 @@
  */
 
 
+typedef struct {
+	symmetric_key skey;
+} aar_cipher;
+
 void
-EncryptBlocks(void* _dest, size nblocks, aes_key key)
+CipherInit(aar_cipher* cipher, aes_key key)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	(void) aes_setup((ubyte*) &key, AAR_KEY_SIZE, 0, &cipher->skey);
+#endif
+}
+
+void
+CipherWipe(aar_cipher* cipher)
+{
+#ifndef _AAR_DEBUG_NOCRYPT
+	aes_done(&cipher->skey);
+#endif
+	bzero(cipher, sizeof(*cipher));
+}
+
+void
+EncryptBlocks(void* _dest, size nblocks, aar_cipher* cipher)
 {
 #ifndef _AAR_DEBUG_NOCRYPT
-	symmetric_key skey;
 	ubyte* dest = _dest;
-	(void) aes_setup((ubyte*) &key, AAR_KEY_SIZE, 0, &skey);
 	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
 		for (size i = 0; i < nblocks; i++) {
 			ubyte* t = dest + (AAR_BLOCK_SIZE * i);
-			(void) aes_ecb_encrypt(t, t, &skey);
+			(void) aes_ecb_encrypt(t, t, &cipher->skey);
 		}
 	}
-	aes_done(&skey);
 #endif
 }
 
 void
-DecryptBlocks(void* _dest, size nblocks, aes_key key)
+DecryptBlocks(void* _dest, size nblocks, aar_cipher* cipher)
 {
 #ifndef _AAR_DEBUG_NOCRYPT
-	symmetric_key skey;
 	ubyte* dest = _dest;
-	(void) aes_setup((ubyte*) &key, AAR_KEY_SIZE, 0, &skey);
 	for (size pass = 0; pass < AAR_CRYPT_PASSES; pass++) {
 		for (size i = 0; i < nblocks; i++) {
 			ubyte* t = dest + (AAR_BLOCK_SIZE * i);
-			(void) aes_ecb_decrypt(t, t, &skey);
+			(void) aes_ecb_decrypt(t, t, &cipher->skey);
 		}
 	}
-	aes_done(&skey);
 #endif
 }
@@ -50,6 +50,101 @@ FileSize(file* fp)
 	return file_length;
 }
 
+// Bytes of an IO buffer that are always there, see IoBuffer().
+#define AAR_IOBUF_SPARE KiloBytes(4)
+
+/*
+  An IO buffer is used by everything that streams file data. It starts
+  out empty and grows to fit the largest request, but never past its
+  limit. It's locked in memory, since it holds plaintext, and wiped by
+  IoBufferWipe(). Every archive points at one, so archives with their
+  own buffers can be worked on by different threads at once.
+
+  WARNING: A buffer isn't thread-safe.
+*/
+typedef struct {
+	byte* data;
+	size length;   // Allocated bytes, a multiple of AAR_BLOCK_SIZE
+	size limit;    // Never allocate more than this
+	bool locked;
+	byte spare[AAR_IOBUF_SPARE]; // Used when nothing can be allocated
+} aar_iobuf;
+
+/* Cap buf at limit bytes, rounded down to whole blocks. */
+void
+IoBufferLimit(aar_iobuf* buf, size limit)
+{
+	limit -= limit % AAR_BLOCK_SIZE;
+	buf->limit = (limit < AAR_BLOCK_SIZE) ? AAR_BLOCK_SIZE : limit;
+}
+
+/* Return the most bytes buf will ever hold. */
+size
+IoBufferMax(aar_iobuf* buf)
+{
+	return buf->limit;
+}
+
+/* Zero, unlock and free buf. It can be used again afterwards. */
+void
+IoBufferWipe(aar_iobuf* buf)
+{
+	bzero(buf->spare, sizeof(buf->spare));
+	if (!buf->data) {
+		return;
+	}
+
+	bzero(buf->data, buf->length);
+	if (buf->locked) {
+		UnlockMemory(buf->data, buf->length);
+	}
+	free(buf->data);
+
+	buf->data = NULL;
+	buf->length = 0;
+	buf->locked = false;
+}
+
+/*
+  Return the memory of buf, grown to hold want bytes if the limit
+  allows, and store its usable length in *length. The length is always
+  a multiple of AAR_BLOCK_SIZE. Contents are left over from the last
+  user.
+
+  If memory runs out, the buffer stays as it was, or falls back on its
+  spare bytes, so *length may be less than want even under the limit.
+  Callers work through the data *length bytes at a time.
+*/
+byte*
+IoBuffer(aar_iobuf* buf, size want, size* length)
+{
+	want = AAR_PADDING(want);
+	if (want > buf->limit) {
+		want = buf->limit;
+	}
+	if (want < AAR_BLOCK_SIZE) {
+		want = AAR_BLOCK_SIZE;
+	}
+
+	if (want > buf->length && want > AAR_IOBUF_SPARE) {
+		byte* data = malloc(want);
+		if (data) {
+			IoBufferWipe(buf);
+			buf->data = data;
+			buf->length = want;
+			buf->locked = LockMemory(data, want);
+		}
+	}
+
+	if (buf->length < AAR_IOBUF_SPARE) {
+		*length = AAR_IOBUF_SPARE;
+		return buf->spare;
+	}
+
+	*length = buf->length;
+	return buf->data;
+}
+
 static void
 InvertByteOrder(byte* buf, size blocksize, size blocks)
 {
@@ -91,11 +186,59 @@ FromDisk(void* buf, size blocksize, size blocks)
 	ToDisk(buf, blocksize, blocks);
 }
 
+// Smallest shift worth handing to copy_file_range(2). Chunks can't be
+// bigger than the shift, so smaller ones cost too many syscalls.
+#define AAR_KERNEL_COPY_MIN KiloBytes(64)
+
+/*
+  Move n bytes at pos by offset. Ranges that don't overlap are copied
+  in the kernel when possible, the rest goes through iobuf. Should
+  iobuf come up short, the bytes are moved in pieces, starting from
+  the end they move towards so none are overwritten before they move.
+  Returns false if they couldn't all be moved.
+*/
+static bool
+MoveChunk(file* fp, aar_iobuf* iobuf, i64 offset, size pos, size n)
+{
+	size done = 0;
+	size shift = (offset < 0) ? -offset : offset;
+
+	if (n <= shift && shift >= AAR_KERNEL_COPY_MIN) {
+		done = CopyFileRange(fp, pos, fp, pos + offset, n);
+	}
+
+	size lo = pos + done;
+	size hi = pos + n;
+	while (lo < hi) {
+		size buf_size;
+		byte* buf = IoBuffer(iobuf, hi - lo, &buf_size);
+		size len = (hi - lo < buf_size) ? hi - lo : buf_size;
+		size at = (offset > 0) ? hi - len : lo;
+
+		size got = ReadAt(fp, buf, len, at);
+		if (WriteAt(fp, buf, got, at + offset) < got || got < len) {
+			return false;
+		}
+
+		if (offset > 0) {
+			hi -= len;
+		} else {
+			lo += len;
+		}
+	}
+
+	return true;
+}
+
 /*
   Shift an interval (x0, x1) of data within a file. If offset > 0, the
   data is shifted downwards to EOF. Otherwise, the data is shifted
   upward, towards the beginning of the file.
 
+  When the interval runs to EOF, the shift is first tried as an extent
+  operation (see ShiftFileExtents()), which moves no data at all. Next
+  come chunks copied in the kernel, and last the IO buffer.
+
   Diagram of data displaying variables when data is being shifted
   downwards:
 
@@ -105,29 +248,30 @@ FromDisk(void* buf, size blocksize, size blocks)
                      \    /
                     chunk_size
 
-  WARNING: Not thread-safe.
+  Returns false if the data couldn't all be moved.
+
+  WARNING: Not thread-safe, it uses iobuf.
 */
-void
-ShiftFileData(file* fp, int offset, size x0, size x1)
+bool
+ShiftFileData(file* fp, aar_iobuf* iobuf, i64 offset, size x0, size x1)
 {
 	// Catch programming errors
 	assert(x1 > x0);
 	assert(fp);
 
-	static byte chunk[AAR_IOBUF];
-	size chunk_size = sizeof(chunk);
+	size chunk_size;
 	size fsize = FileSize(fp);
-	size dx = x1 - x0;
-
-	bzero(chunk, chunk_size);
+	size shift = (offset < 0) ? -offset : offset;
+	size dx;
+	bool ok = true;
 
 	// Nothing to do.
 	if (x0 >= fsize || x1 <= 0 || offset == 0) {
-		return;
+		return true;
 	}
 
 	// Data moved beyond x0 is truncated.
-	if ((int)(x0 + offset) < 0) {
+	if ((i64) x0 + offset < 0) {
 		x0 -= offset;
 	}
 
@@ -135,8 +279,21 @@ ShiftFileData(file* fp, int offset, size x0, size x1)
 		x1 = fsize;
 	}
 
-	if (chunk_size > dx) {
-		chunk_size = dx;
+	if (x1 <= x0) {
+		return true;
+	}
+
+	dx = x1 - x0;
+	(void) fflush(fp);
+
+	if (x1 == fsize && ShiftFileExtents(fp, offset, x0)) {
+		(void) fseek(fp, (offset > 0) ? x0 : x1, SEEK_SET);
+		return true;
+	}
+
+	chunk_size = (dx < iobuf->limit) ? dx : iobuf->limit;
+	if (shift >= AAR_KERNEL_COPY_MIN && chunk_size > shift) {
+		chunk_size = shift;
 	}
 
 	// Move full chunks
@@ -149,10 +306,7 @@ ShiftFileData(file* fp, int offset, size x0, size x1)
 			chunk_position = x0 + (chunk_size * i);
 		}
 
-		(void) fseek(fp, chunk_position, SEEK_SET);
-		(void) fread(chunk, sizeof(byte), chunk_size, fp);
-		(void) fseek(fp, chunk_position + offset, SEEK_SET);
-		(void) fwrite(chunk, sizeof(byte), chunk_size, fp);
+		ok = MoveChunk(fp, iobuf, offset, chunk_position, chunk_size) && ok;
 	}
 
 	// If there's a partial chunk, move it
@@ -163,20 +317,50 @@ ShiftFileData(file* fp, int offset, size x0, size x1)
 			chunk_position = x1 - chunk_size;
 		}
 
-		(void) fseek(fp, chunk_position, SEEK_SET);
-		(void) fread(chunk, sizeof(byte), chunk_size, fp);
-		(void) fseek(fp, chunk_position + offset, SEEK_SET);
-		(void) fwrite(chunk, sizeof(byte), chunk_size, fp);
+		ok = MoveChunk(fp, iobuf, offset, chunk_position, chunk_size) && ok;
 	}
 
 	// Removing trailing garbage if exists.
 	if (x1 == fsize && offset < 0) {
 		(void) fflush(fp);
-		(void) TruncateFile(fp, fsize + offset);
+		ok = TruncateFile(fp, fsize + offset) && ok;
 	}
 
-	(void) fflush(fp);
+	ok = fflush(fp) == 0 && ok;
 
 	// Set pointer to a reasonable location
 	(void) fseek(fp, (offset > 0) ? x0 : x1, SEEK_SET);
+	return ok;
+}
+
+/*
+  Copy len bytes at src in fin to dst in fout, inside the kernel if it
+  can and through iobuf if not. fout's position is left after the
+  copy.
+*/
+void
+CopyFileData(file* fin, size src, file* fout, size dst, size len, aar_iobuf* iobuf)
+{
+	size done;
+
+	(void) fflush(fin);
+	(void) fflush(fout);
+	done = CopyFileRange(fin, src, fout, dst, len);
+
+	if (done < len) {
+		size buf_size;
+		byte* buf = IoBuffer(iobuf, len - done, &buf_size);
+
+		while (done < len) {
+			size n = (len - done < buf_size) ? len - done : buf_size;
+			if (n = ReadAt(fin, buf, n, src + done), n == 0) {
+				break;
+			}
+			(void) WriteAt(fout, buf, n, dst + done);
+			done += n;
+		}
+	}
+
+	(void) fflush(fout);
+	(void) fseek(fout, dst + done, SEEK_SET);
 }
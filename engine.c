@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  Multi-threaded ECB engine.
+
+  Every block is encrypted independently, so a buffer can be cut into
+  slices and handed to ParallelFor(). The output is byte-identical to
+  a single EncryptBlocks()/DecryptBlocks() call over the whole buffer.
+
+  The fused variants also checksum the plaintext. Each slice is worked
+  through in AAR_ENGINE_TILE sized tiles that are checksummed and
+  encrypted (or decrypted and checksummed) while they're still in
+  cache, so the data makes one trip through memory instead of two.
+*/
+
+// Smallest slice worth handing to another thread.
+#ifndef AAR_ENGINE_SLICE
+#     define AAR_ENGINE_SLICE MegaBytes(1)
+#endif
+
+// Bytes checksummed and encrypted in one go by the fused kernels.
+#ifndef AAR_ENGINE_TILE
+#     define AAR_ENGINE_TILE KiloBytes(64)
+#endif
+
+typedef struct {
+	byte* dest;
+	size nblocks;       // Blocks in the whole buffer
+	size slice;         // Blocks per job
+	aar_cipher* cipher;
+	bool decrypt;
+
+	// Fused checksum, only used when sums is set
+	size len;               // Plaintext bytes in dest
+	aar_checksum_kind kind;
+	aar_checksum* sums;     // Checksum of each job's slice
+} engine_task;
+
+/*
+  Checksum len bytes of plaintext at p and encrypt or decrypt the
+  blocks holding them, one tile at a time.
+*/
+static aar_checksum
+EngineFused(engine_task* t, aar_cipher* cipher, byte* p, size len, aar_checksum chk)
+{
+	for (size off = 0; off < len; off += AAR_ENGINE_TILE) {
+		size n = len - off;
+		if (n > AAR_ENGINE_TILE) {
+			n = AAR_ENGINE_TILE;
+		}
+
+		if (t->decrypt) {
+			DecryptBlocks(p + off, AAR_BLOCKS(n), cipher);
+			chk = Checksum(t->kind, chk, (u8*) p + off, n);
+		} else {
+			chk = Checksum(t->kind, chk, (u8*) p + off, n);
+			EncryptBlocks(p + off, AAR_BLOCKS(n), cipher);
+		}
+	}
+
+	return chk;
+}
+
+static void
+EngineJob(void* ctx, size job)
+{
+	engine_task* t = ctx;
+	size first = job * t->slice;
+	size n = t->nblocks - first;
+
+	// Some backends use their context as scratch space.
+	aar_cipher cipher = *t->cipher;
+
+	if (n > t->slice) {
+		n = t->slice;
+	}
+
+	if (t->sums) {
+		size len = t->len - first * AAR_BLOCK_SIZE;
+		if (len > n * AAR_BLOCK_SIZE) {
+			len = n * AAR_BLOCK_SIZE;
+		}
+		t->sums[job] = EngineFused(t, &cipher, t->dest + first * AAR_BLOCK_SIZE, len, AAR_CHECKSUM_INIT);
+	} else if (t->decrypt) {
+		DecryptBlocks(t->dest + first * AAR_BLOCK_SIZE, n, &cipher);
+	} else {
+		EncryptBlocks(t->dest + first * AAR_BLOCK_SIZE, n, &cipher);
+	}
+
+	bzero(&cipher, sizeof(cipher));
+}
+
+static void
+EngineRun(void* dest, size nblocks, aar_cipher* cipher, size threads, bool decrypt)
+{
+	size min_slice = AAR_ENGINE_SLICE / AAR_BLOCK_SIZE;
+	engine_task t = {dest, nblocks, 0, cipher, decrypt};
+
+	if (threads <= 1 || nblocks < 2 * min_slice) {
+		if (decrypt) {
+			DecryptBlocks(dest, nblocks, cipher);
+		} else {
+			EncryptBlocks(dest, nblocks, cipher);
+		}
+		return;
+	}
+
+	t.slice = (nblocks + threads - 1) / threads;
+	if (t.slice < min_slice) {
+		t.slice = min_slice;
+	}
+
+	ParallelFor((nblocks + t.slice - 1) / t.slice, threads, EngineJob, &t);
+}
+
+/* Encrypt nblocks blocks of dest in place with up to threads threads. */
+void
+EncryptBlocksParallel(void* dest, size nblocks, aar_cipher* cipher, size threads)
+{
+	EngineRun(dest, nblocks, cipher, threads, false);
+}
+
+/* Decrypt nblocks blocks of dest in place with up to threads threads. */
+void
+DecryptBlocksParallel(void* dest, size nblocks, aar_cipher* cipher, size threads)
+{
+	EngineRun(dest, nblocks, cipher, threads, true);
+}
+
+static aar_checksum
+EngineRunFused(aar_checksum_kind kind, aar_checksum chk, void* buf, size len,
+	       aar_cipher* cipher, size threads, bool decrypt)
+{
+	size min_slice = AAR_ENGINE_SLICE / AAR_BLOCK_SIZE;
+	size nblocks = AAR_BLOCKS(len);
+	engine_task t = {buf, nblocks, 0, cipher, decrypt, len, kind};
+
+	if (threads <= 1 || nblocks < 2 * min_slice) {
+		return EngineFused(&t, cipher, buf, len, chk);
+	}
+
+	// Slices can only be checksummed apart if their sums can be
+	// combined. Otherwise take two passes.
+	if (!ChecksumCombinable(kind)) {
+		if (!decrypt) {
+			chk = Checksum(kind, chk, buf, len);
+		}
+		EngineRun(buf, nblocks, cipher, threads, decrypt);
+		if (decrypt) {
+			chk = Checksum(kind, chk, buf, len);
+		}
+		return chk;
+	}
+
+	t.slice = (nblocks + threads - 1) / threads;
+	if (t.slice < min_slice) {
+		t.slice = min_slice;
+	}
+
+	size jobs = (nblocks + t.slice - 1) / t.slice;
+	aar_checksum sums[jobs];
+	t.sums = sums;
+
+	ParallelFor(jobs, threads, EngineJob, &t);
+
+	for (size job = 0; job < jobs; job++) {
+		size slice_len = len - job * t.slice * AAR_BLOCK_SIZE;
+		if (slice_len > t.slice * AAR_BLOCK_SIZE) {
+			slice_len = t.slice * AAR_BLOCK_SIZE;
+		}
+		chk = ChecksumCombine(kind, chk, sums[job], slice_len);
+	}
+
+	return chk;
+}
+
+/*
+  Checksum len bytes of plaintext in buf, continuing from chk, and
+  encrypt the AAR_BLOCKS(len) blocks holding them in place. Bytes
+  between len and the end of the last block must already be zeroed.
+  Returns the updated checksum.
+*/
+aar_checksum
+EncryptChecksum(aar_checksum_kind kind, aar_checksum chk, void* buf, size len,
+		aar_cipher* cipher, size threads)
+{
+	return EngineRunFused(kind, chk, buf, len, cipher, threads, false);
+}
+
+/*
+  Decrypt the AAR_BLOCKS(len) blocks of buf in place and checksum the
+  first len bytes of plaintext, continuing from chk. Returns the
+  updated checksum.
+*/
+aar_checksum
+DecryptChecksum(aar_checksum_kind kind, aar_checksum chk, void* buf, size len,
+		aar_cipher* cipher, size threads)
+{
+	return EngineRunFused(kind, chk, buf, len, cipher, threads, true);
+}
@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  libaar, see libaar.h.
+
+  This pulls in the unity build without aar's Main() and `mem`, so it
+  is built with the same macro flags as aar itself, plus hidden
+  visibility so only the aar_* API is exported (`bmake libaar.a
+  libaar.so` does this):
+
+      cc -O2 -fPIC -fvisibility=hidden -D AAR_OS_POSIX -c libaar.c
+
+  Every archive is opened quietly, with its own IO buffer and cipher,
+  so handles never share scratch space.
+*/
+
+#define AAR_NO_MAIN
+#include "build.c"
+#include "libaar.h"
+
+struct aar_context {
+	aes_key key;
+	size jobs;
+	size io_buffer;
+};
+
+struct aar_handle {
+	aar_context* ctx;
+	aar_archive ar;
+	aar_cipher cipher;
+	aar_iobuf iobuf;
+};
+
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+static aar_error
+ErrorOf(aar_file_status status)
+{
+	switch (status) {
+	case AAR_FILE_OK:          return AAR_OK;
+	case AAR_FILE_NO_MEMORY:   return AAR_ENOMEM;
+	case AAR_FILE_UNOPENED:    return AAR_EOPEN;
+	case AAR_FILE_WRONG_KEY:   return AAR_EKEY;
+	case AAR_FILE_INVALID:
+	case AAR_FILE_UNSUPPORTED:
+	case AAR_FILE_NOT_AAR:     return AAR_EFORMAT;
+	case AAR_FILE_NO_CHECKSUM:
+	case AAR_FILE_CORRUPT:     return AAR_ECORRUPT;
+	default:                   return AAR_EIO;
+	}
+}
+
+/*
+  Return the error of the last writes to h's archive. written is false
+  if one made with pwrite(2), which ferror(3) doesn't see, failed.
+*/
+static aar_error
+WriteError(aar_handle* h, bool written)
+{
+	aar_error err = (!written || ferror(h->ar.fp)) ? AAR_EIO : AAR_OK;
+
+	clearerr(h->ar.fp);
+	return err;
+}
+
+aar_error
+aar_context_new(const char* key, aar_context** ctx)
+{
+	aes_key_ok k = Base64DecodeKey($$(key));
+	aar_context* c;
+
+	if (!k.ok) {
+		return AAR_EKEY;
+	}
+	if (c = calloc(1, sizeof(aar_context)), !c) {
+		bzero(&k, sizeof(k));
+		return AAR_ENOMEM;
+	}
+
+	(void) pthread_once(&checksum_once, ChecksumSetup);
+	c->key = k.value;
+	c->jobs = CpuCount();
+	c->io_buffer = AAR_IOBUF;
+	bzero(&k, sizeof(k));
+
+	*ctx = c;
+	return AAR_OK;
+}
+
+void
+aar_context_set_jobs(aar_context* ctx, size_t jobs)
+{
+	ctx->jobs = (jobs > 0) ? jobs : 1;
+}
+
+void
+aar_context_set_io_buffer(aar_context* ctx, size_t bytes)
+{
+	ctx->io_buffer = bytes;
+}
+
+void
+aar_context_free(aar_context* ctx)
+{
+	if (!ctx) {
+		return;
+	}
+	bzero(ctx, sizeof(aar_context));
+	free(ctx);
+}
+
+aar_error
+aar_open(aar_context* ctx, const char* path, aar_handle** h)
+{
+	aar_handle* a = calloc(1, sizeof(aar_handle));
+	aar_file_status status;
+
+	if (!a) {
+		return AAR_ENOMEM;
+	}
+
+	a->ctx = ctx;
+	IoBufferLimit(&a->iobuf, ctx->io_buffer);
+	CipherInit(&a->cipher, ctx->key);
+	a->ar.cipher = &a->cipher;
+	a->ar.iobuf = &a->iobuf;
+	a->ar.jobs = ctx->jobs;
+	a->ar.quiet = true;
+
+	if (status = OpenArchive(&a->ar, $$(path), ctx->key), status != AAR_FILE_OK) {
+		CipherWipe(&a->cipher);
+		free(a);
+		return ErrorOf(status);
+	}
+
+	*h = a;
+	return AAR_OK;
+}
+
+aar_error
+aar_close(aar_handle* h)
+{
+	bool ok = CloseArchive(&h->ar);
+
+	IoBufferWipe(&h->iobuf);
+	CipherWipe(&h->cipher);
+	bzero(h, sizeof(aar_handle));
+	free(h);
+	return ok ? AAR_OK : AAR_EIO;
+}
+
+aar_error
+aar_validate(aar_handle* h)
+{
+	aar_record_iter it = IterRecords(&h->ar);
+	aar_error err = AAR_OK;
+
+	while (NextRecord(&it)) {
+		aar_error e = ErrorOf(DecryptRecord(&h->ar, it.hdr, it.data, NULL, NULL));
+		if (err == AAR_OK) {
+			err = e;
+		}
+	}
+
+	if (err == AAR_OK && !WalkedAll(&it)) {
+		err = AAR_ECORRUPT;
+	}
+	return err;
+}
+
+aar_error
+aar_records(aar_handle* h, int (*fn)(void* arg, const aar_record_info* rec), void* arg)
+{
+	aar_record_iter it = IterRecords(&h->ar);
+	char desc[AAR_DESC_MAX + 1];
+
+	while (NextRecord(&it)) {
+		aar_record_info rec = {it.index, desc, it.hdr.desc_length};
+
+		memcpy(desc, it.hdr.desc, it.hdr.desc_length);
+		desc[it.hdr.desc_length] = '\0';
+		rec.length = it.hdr.block_count * AAR_BLOCK_SIZE - it.hdr.block_offset;
+		if (fn(arg, &rec) != 0) {
+			break;
+		}
+	}
+
+	bzero(desc, sizeof(desc));
+	return WalkedAll(&it) ? AAR_OK : AAR_ECORRUPT;
+}
+
+aar_error
+aar_add_fd(aar_handle* h, int fd, const char* desc)
+{
+	string d = $$(desc);
+	file* fin;
+
+	if (d.length > AAR_DESC_MAX) {
+		return AAR_ERANGE;
+	}
+	if (fin = OpenFd(fd, "rb"), !fin) {
+		return AAR_EOPEN;
+	}
+
+	PrepareIndex(&h->ar);
+	bool written = IngestStream(&h->ar, fin, d);
+
+	aar_error err = ferror(fin) ? AAR_EIO : WriteError(h, written);
+	(void) fclose(fin);
+	return err;
+}
+
+aar_error
+aar_add_buffer(aar_handle* h, const void* data, size_t length, const char* desc)
+{
+	string d = $$(desc);
+
+	if (d.length > AAR_DESC_MAX) {
+		return AAR_ERANGE;
+	}
+
+	PrepareIndex(&h->ar);
+	return WriteError(h, IngestBuffer(&h->ar, data, length, d));
+}
+
+aar_error
+aar_extract_fd(aar_handle* h, size_t index, int fd)
+{
+	aar_record_header hdr;
+	size offset, data;
+	file* out;
+
+	if (!FindRecord(&h->ar, index, &hdr, &offset, &data)) {
+		return AAR_ENORECORD;
+	}
+	if (out = OpenFd(fd, "wb"), !out) {
+		return AAR_EOPEN;
+	}
+
+	aar_error err = ErrorOf(DecryptRecord(&h->ar, hdr, data, out, NULL));
+	return (fclose(out) != 0 && err == AAR_OK) ? AAR_EIO : err;
+}
+
+aar_error
+aar_extract_buffer(aar_handle* h, size_t index, void* buf, size_t capacity, size_t* length)
+{
+	aar_record_header hdr;
+	size offset, data;
+
+	if (!FindRecord(&h->ar, index, &hdr, &offset, &data)) {
+		return AAR_ENORECORD;
+	}
+
+	*length = hdr.block_count * AAR_BLOCK_SIZE - hdr.block_offset;
+	if (*length > capacity) {
+		return AAR_ERANGE;
+	}
+
+	return ErrorOf(DecryptRecord(&h->ar, hdr, data, NULL, buf));
+}
+
+aar_error
+aar_delete(aar_handle* h, size_t index)
+{
+	size target = index;
+	size deleted;
+
+	PrepareIndex(&h->ar);
+	aar_file_status status = DeleteRecords(&h->ar, &target, 1, &deleted);
+
+	if (status != AAR_FILE_OK && status != AAR_FILE_UNWRITTEN) {
+		return ErrorOf(status);
+	}
+	if (deleted == 0) {
+		return AAR_ENORECORD;
+	}
+	return WriteError(h, status == AAR_FILE_OK);
+}
+
+const char*
+aar_strerror(aar_error err)
+{
+	switch (err) {
+	case AAR_OK:        return "Success";
+	case AAR_ENOMEM:    return "Out of memory";
+	case AAR_EKEY:      return "Invalid key, or not the archive's key";
+	case AAR_EOPEN:     return "Failed to open the file";
+	case AAR_EFORMAT:   return "Not an archive, or an unsupported format";
+	case AAR_ECORRUPT:  return "Checksum mismatch, the data is corrupted";
+	case AAR_ENORECORD: return "Record doesn't exist";
+	case AAR_ERANGE:    return "Buffer or description out of range";
+	case AAR_EIO:       return "Failed to read or write the file";
+	}
+	return "Unknown error";
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  libaar works on aar archives from inside another program.
+
+  A context holds a key and settings. Once its settings are made, it's
+  only read, so any number of threads may open handles on it at once.
+  An archive is opened into a handle, which has its own cipher, IO
+  buffer and index. A handle must only be used by one thread at a
+  time, but different handles may be used at once, even on the same
+  context.
+
+  Nothing is printed and the process is never exited. Every call
+  returns AAR_OK or an error, see aar_strerror().
+
+      aar_context* ctx;
+      aar_handle* h;
+
+      if (aar_context_new("<base64 key>", &ctx) == AAR_OK
+          && aar_open(ctx, "keys.aar", &h) == AAR_OK) {
+              aar_add_fd(h, fd, "id_ed25519");
+              aar_close(h);
+      }
+      aar_context_free(ctx);
+
+  Records are numbered from 0 in archive order, as by `aar list`.
+*/
+
+#ifndef LIBAAR_H
+#define LIBAAR_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libaar is built with -fvisibility=hidden, so only these are exported.
+#if defined(__GNUC__) || defined(__clang__)
+#     define AAR_API __attribute__((visibility("default")))
+#else
+#     define AAR_API
+#endif
+
+typedef struct aar_context aar_context;
+typedef struct aar_handle aar_handle;
+
+typedef enum {
+	AAR_OK = 0,
+	AAR_ENOMEM,         // Out of memory
+	AAR_EKEY,           // Invalid key, or not the archive's key
+	AAR_EOPEN,          // The archive couldn't be opened
+	AAR_EFORMAT,        // Not an archive, or an unsupported format
+	AAR_ECORRUPT,       // A checksum doesn't match the data
+	AAR_ENORECORD,      // No record has that number
+	AAR_ERANGE,         // A buffer or description is too small or big
+	AAR_EIO,            // Reading or writing failed
+} aar_error;
+
+// A record, as passed to the callback of aar_records().
+typedef struct {
+	size_t index;
+	const char* desc;   // NUL terminated
+	size_t desc_length;
+	uint64_t length;    // Bytes of data
+} aar_record_info;
+
+// Make a context for the base64 encoded key, as `aar -k` takes it.
+AAR_API aar_error aar_context_new(const char* key, aar_context** ctx);
+
+// Use up to jobs threads for bulk encryption. The default is the CPU count.
+AAR_API void aar_context_set_jobs(aar_context* ctx, size_t jobs);
+
+// Never let a handle's IO buffer grow past bytes. The default is 100 MB.
+AAR_API void aar_context_set_io_buffer(aar_context* ctx, size_t bytes);
+
+// Wipe the key and free ctx. Every handle using it must be closed.
+AAR_API void aar_context_free(aar_context* ctx);
+
+// Open the archive at path, which must have been made with ctx's key.
+AAR_API aar_error aar_open(aar_context* ctx, const char* path, aar_handle** h);
+
+// Write out h's record index if it changed and close h.
+AAR_API aar_error aar_close(aar_handle* h);
+
+// Read every record and check its data against its checksum. A corrupted
+// record header is AAR_ECORRUPT, as the records after it can't be found.
+AAR_API aar_error aar_validate(aar_handle* h);
+
+// Call fn for every record in order, until it returns nonzero. Returns
+// AAR_ECORRUPT if a corrupted record header ends the walk early.
+AAR_API aar_error aar_records(aar_handle* h, int (*fn)(void* arg, const aar_record_info* rec), void* arg);
+
+// Add everything read from fd, which may be a pipe, as a record.
+AAR_API aar_error aar_add_fd(aar_handle* h, int fd, const char* desc);
+
+// Add the length bytes at data as a record.
+AAR_API aar_error aar_add_buffer(aar_handle* h, const void* data, size_t length, const char* desc);
+
+// Write the data of record index to fd.
+AAR_API aar_error aar_extract_fd(aar_handle* h, size_t index, int fd);
+
+/*
+  Decrypt the data of record index into buf, which holds capacity
+  bytes. *length is set to the record's length even if it doesn't fit,
+  when AAR_ERANGE is returned.
+*/
+AAR_API aar_error aar_extract_buffer(aar_handle* h, size_t index, void* buf, size_t capacity, size_t* length);
+
+// Delete record index. The records after it are renumbered. Returns
+// AAR_ENORECORD if there's no such record and AAR_EIO if the archive
+// couldn't be rewritten.
+AAR_API aar_error aar_delete(aar_handle* h, size_t index);
+
+// Describe an error.
+AAR_API const char* aar_strerror(aar_error err);
+
+#endif
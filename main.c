@@ -14,7 +14,8 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-// Global memory regions
+#ifndef AAR_NO_MAIN
+// Global memory regions of the aar command. Library builds have none.
 struct {
 	struct {
 		aes_key raw;                      // 256 bit AES key for encrypting archive.
@@ -22,23 +23,139 @@ struct {
 		byte base64[AAR_BASE64_KEY_SIZE]; // Base64 encoded AES key (It's always 44 bytes long).
 	} key;
 
+	aar_cipher cipher;          // Expanded key schedule of key.raw. Set up once per process.
+	aar_iobuf iobuf;            // IO buffer of every archive and file the command works on.
+	size jobs;                  // Worker threads used for bulk encryption.
+	aar_checksum_kind checksum; // Checksum used by new archives.
+	size align;                 // Record alignment of new archives.
+	bool log;                   // New archives are log archives.
+
 	struct {
 		string archive;  // Archive filename.
 		string key;      // String object for mem.key.base64
 	} stable;
 } mem = {0};
+#endif
+
+// An entry of the record index, see aar.h.
+typedef struct {
+	size offset;            // Byte offset of the record header
+	u64 block_count;
+	u64 block_offset;
+	u64 desc_length;
+	size desc;              // Offset of the description in aar_index.descs
+	aar_checksum checksum;  // Checksum of the record's data
+} aar_index_entry;
+
+// An archive's record index, read into memory.
+typedef struct {
+	aar_index_entry* entries;
+	size count;
+	size capacity;
+	u8* descs;              // Descriptions of every entry back to back
+	size descs_length;
+	size descs_capacity;
+	bool ok;                // Matches the records on disk
+	bool dirty;             // Changed since it was read
+} aar_index;
+
+// An archive, or a standalone file made by EncryptFile(), opened for
+// reading and writing records.
+typedef struct {
+	file* fp;
+	aar_cipher* cipher;
+	aar_format format;
+	size start;         // Byte offset of the first record
+	size end;           // Byte offset just past the last record
+	aar_index index;
+	aar_iobuf* iobuf;   // Buffer for streaming data, only one thread uses it at a time
+	size jobs;          // Threads used for bulk encryption
+	bool quiet;         // Don't print messages, only return errors
+} aar_archive;
+
+// How encrypting or decrypting a standalone file went.
+typedef enum {
+	AAR_FILE_OK,
+	AAR_FILE_UNOPENED,      // It couldn't be opened
+	AAR_FILE_WRONG_KEY,     // An archive made with another key
+	AAR_FILE_INVALID,       // Too short to be encrypted
+	AAR_FILE_UNSUPPORTED,   // Unknown format block
+	AAR_FILE_NOT_AAR,       // No valid record header
+	AAR_FILE_NO_CHECKSUM,   // Decrypted, but the checksum is missing
+	AAR_FILE_CORRUPT,       // Decrypted, but the checksum doesn't match
+	AAR_FILE_UNWRITTEN,     // The output couldn't all be written
+	AAR_FILE_NO_MEMORY,     // Out of memory
+	AAR_FILE_UNMAPPED,      // Left untouched, it needs the IO buffer
+} aar_file_status;
+
+// Bytes a record walk reads at once, so that the headers of small
+// records come many to a read.
+#define AAR_READAHEAD KiloBytes(16)
+
+// Walks an archive's records in order, reading each header once.
+typedef struct {
+	aar_archive* ar;
+	size count;             // Records read so far
+	size index;             // Number of the record in hdr
+	size offset;            // Byte offset of hdr
+	size next;              // Byte offset of the record after it
+	bool raw;               // Return log records instead of skipping them
+	bool corrupt;           // Stopped at a header that can't be read
+	aar_record_header hdr;
+	size data;              // Byte offset of hdr's data
+	size ahead_offset;      // Byte offset of ahead[0]
+	size ahead_length;      // Bytes in ahead, short at the end of the file
+	u8 ahead[AAR_READAHEAD];
+} aar_record_iter;
+
+/* Parse a byte count with an optional K, M or G suffix. */
+size_ok
+ParseBytes(string s)
+{
+	size_ok result = {0};
+	size unit = 1;
 
-aar_checksum
-Checksum(aar_checksum state, u8* buf, size buf_len)
+	if (s.length == 0) {
+		return result;
+	}
+
+	switch (s.s[s.length - 1]) {
+	case 'K': unit = KiloBytes(1); s.length--; break;
+	case 'M': unit = MegaBytes(1); s.length--; break;
+	case 'G': unit = GigaBytes(1); s.length--; break;
+	}
+
+	if (s.length == 0) {
+		return result;
+	}
+
+	for (size i = 0; i < s.length; i++) {
+		if (s.s[i] < '0' || s.s[i] > '9') {
+			return result;
+		}
+		result.value = result.value * 10 + (s.s[i] - '0');
+	}
+
+	result.value *= unit;
+	result.ok = true;
+	return result;
+}
+
+/* Parse a record number, which is only digits. */
+size_ok
+ParseIndex(string s)
 {
-	// 32-bit derivative of the BSD checksum.
-	// (Performs better than CRC32 for us.)
-	for (int i = 0; i < buf_len; i++) {
-		state >>= 1;
-		state += (state & 1) << 31;
-		state += buf[i];
+	size_ok result = {0};
+
+	for (size i = 0; i < s.length; i++) {
+		if (s.s[i] < '0' || s.s[i] > '9') {
+			return result;
+		}
+		result.value = result.value * 10 + (s.s[i] - '0');
 	}
-	return state;
+
+	result.ok = s.length > 0;
+	return result;
 }
 
 string
@@ -72,21 +189,165 @@ Base64DecodeKey(string s)
 }
 
 aes_key_ok
-ArchiveValidate(file* fp, aes_key given_key)
+ArchiveValidate(file* fp, aes_key given_key, aar_cipher* cipher)
 {
 	aes_key_ok archive_key = {0};
 
 	if (fread(&archive_key.value, AAR_KEY_SIZE, 1, fp) != 1) {
-		Println$("Failed to read key.");
 		return archive_key;
 	}
 
-	DecryptBlocks((byte*) &archive_key.value, 2, given_key);
+	DecryptBlocks((byte*) &archive_key.value, 2, cipher);
 	archive_key.ok = memcmp(&archive_key.value, &given_key, AAR_KEY_SIZE) == 0;
 
 	return archive_key;
 }
 
+/* Round offset up to where the archive's next record may start. */
+size
+AlignRecord(aar_archive* ar, size offset)
+{
+	size align = ar->format.align;
+
+	if (align <= 1) {
+		return offset;
+	}
+	return (offset + align - 1) / align * align;
+}
+
+/* Does ar have a format block? Legacy archives don't. */
+bool
+HasFormatBlock(aar_archive* ar)
+{
+	return ar->format.checksum != AAR_CHECKSUM_BSD || ar->format.align > 1 || ar->format.log;
+}
+
+/*
+  Read the format block at the current position of ar->fp, if there's
+  one, set ar->format and ar->start and move to ar->start. Without a
+  format block the position is left alone and the legacy format is
+  assumed. Returns false if the block names a format this build
+  doesn't know.
+*/
+bool
+ReadFormat(aar_archive* ar)
+{
+	u8 buf[AAR_FORMAT_SIZE];
+	size pos = ftell(ar->fp);
+
+	bzero(&ar->format, sizeof(ar->format));
+	ar->start = pos;
+
+	if (fread(buf, sizeof(u8), AAR_FORMAT_SIZE, ar->fp) < AAR_FORMAT_SIZE) {
+		(void) fseek(ar->fp, pos, SEEK_SET);
+		return true;
+	}
+	DecryptBlocks(buf, AAR_BLOCKS(AAR_FORMAT_SIZE), ar->cipher);
+
+	if (memcmp(buf, AAR_MAGIC_VERSION, AAR_MAGIC_SIZE) != 0) {
+		(void) fseek(ar->fp, pos, SEEK_SET);
+		return true;
+	}
+
+	if (buf[AAR_MAGIC_SIZE] > AAR_CHECKSUM_CRC32C || buf[AAR_MAGIC_SIZE + 1] > AAR_ALIGN_MAX_SHIFT
+	    || (buf[AAR_MAGIC_SIZE + 2] & ~AAR_FORMAT_LOG) != 0) {
+		return false;
+	}
+
+	ar->format.checksum = buf[AAR_MAGIC_SIZE];
+	ar->format.log = (buf[AAR_MAGIC_SIZE + 2] & AAR_FORMAT_LOG) != 0;
+	if (buf[AAR_MAGIC_SIZE + 1] > 0) {
+		ar->format.align = (size) 1 << buf[AAR_MAGIC_SIZE + 1];
+	}
+
+	{ // Where the record index is
+		u64 index, index_length;
+
+		memcpy(&index, buf + 16, sizeof(index));
+		memcpy(&index_length, buf + 24, sizeof(index_length));
+		FromDisk(&index, sizeof(index), 1);
+		FromDisk(&index_length, sizeof(index_length), 1);
+		ar->format.index = index;
+		ar->format.index_length = index_length;
+	}
+
+	ar->start = AlignRecord(ar, pos + AAR_FORMAT_SIZE);
+	(void) fseek(ar->fp, ar->start, SEEK_SET);
+	return true;
+}
+
+/* Encrypt ar->format into buf as a format block. */
+void
+EncodeFormat(aar_archive* ar, u8 buf[AAR_FORMAT_SIZE])
+{
+	u8 shift = 0;
+	u64 index = ar->format.index;
+	u64 index_length = ar->format.index_length;
+
+	while (((size) 2 << shift) <= ar->format.align) {
+		shift++;
+	}
+
+	ToDisk(&index, sizeof(index), 1);
+	ToDisk(&index_length, sizeof(index_length), 1);
+
+	bzero(buf, AAR_FORMAT_SIZE);
+	memcpy(buf, AAR_MAGIC_VERSION, AAR_MAGIC_SIZE);
+	buf[AAR_MAGIC_SIZE] = ar->format.checksum;
+	buf[AAR_MAGIC_SIZE + 1] = shift;
+	buf[AAR_MAGIC_SIZE + 2] = ar->format.log ? AAR_FORMAT_LOG : 0;
+	memcpy(buf + 16, &index, sizeof(index));
+	memcpy(buf + 24, &index_length, sizeof(index_length));
+	EncryptBlocks(buf, AAR_BLOCKS(AAR_FORMAT_SIZE), ar->cipher);
+}
+
+/*
+  Write ar->format at the current position of ar->fp and set
+  ar->start. The legacy format has no format block, so nothing is
+  written for it. Aligned archives are padded up to their first
+  record.
+*/
+bool
+WriteFormat(aar_archive* ar)
+{
+	u8 buf[AAR_FORMAT_SIZE];
+
+	ar->start = ftell(ar->fp);
+
+	if (!HasFormatBlock(ar)) {
+		return true;
+	}
+
+	EncodeFormat(ar, buf);
+
+	if (fwrite(buf, sizeof(u8), AAR_FORMAT_SIZE, ar->fp) < AAR_FORMAT_SIZE) {
+		return false;
+	}
+
+	fflush(ar->fp);
+	ar->start = AlignRecord(ar, ar->start + AAR_FORMAT_SIZE);
+	if (!TruncateFile(ar->fp, ar->start)) {
+		return false;
+	}
+	(void) fseek(ar->fp, ar->start, SEEK_SET);
+
+	return true;
+}
+
+/* Pad the end of the archive, at the current position, up to the next record. */
+void
+PadRecord(aar_archive* ar)
+{
+	size pos = ftell(ar->fp);
+	size end = AlignRecord(ar, pos);
+
+	if (end > pos) {
+		fflush(ar->fp);
+		(void) TruncateFile(ar->fp, end);
+		(void) fseek(ar->fp, end, SEEK_SET);
+	}
+}
+
 file*
 ArchiveOpen(string filename)
 {
@@ -99,7 +360,7 @@ ArchiveOpen(string filename)
 }
 
 file*
-ArchiveCreate(string filename, aes_key key)
+ArchiveCreate(string filename, aes_key key, aar_cipher* cipher, aar_format format)
 {
 	file* fp;
 	char path[filename.length + 1];
@@ -124,9 +385,12 @@ ArchiveCreate(string filename, aes_key key)
 	}
 
 	encrypted_key = key;
-	EncryptBlocks((byte*) &encrypted_key, 2, key);
+	EncryptBlocks((byte*) &encrypted_key, 2, cipher);
+
+	aar_archive ar = {fp, cipher, format};
 
-	if (fwrite(&encrypted_key, sizeof(byte), AAR_KEY_SIZE, fp) < AAR_KEY_SIZE) {
+	if (fwrite(&encrypted_key, sizeof(byte), AAR_KEY_SIZE, fp) < AAR_KEY_SIZE
+	    || !WriteFormat(&ar)) {
 		Println$("Failed to write data to archive file.");
 		fclose(fp);
 		return NULL;
@@ -135,8 +399,9 @@ ArchiveCreate(string filename, aes_key key)
 	return fp;
 }
 
+/* Make the header of a record holding file_length bytes. */
 aar_record_header
-NewRecord(file* fp, string desc)
+RecordOfLength(string desc, size file_length)
 {
 	aar_record_header hdr = {0};
 
@@ -145,7 +410,6 @@ NewRecord(file* fp, string desc)
 	}
 	memcpy(hdr.desc, desc.s, desc.length);
 
-	size file_length = FileSize(fp);
 	hdr.block_count = AAR_BLOCKS(file_length);
 	hdr.block_offset = hdr.block_count * AAR_BLOCK_SIZE - file_length;
 	hdr.desc_length = desc.length;
@@ -153,12 +417,20 @@ NewRecord(file* fp, string desc)
 	return hdr;
 }
 
-void
-WriteRecord(file* fout, aar_record_header hdr, aes_key key)
+aar_record_header
+NewRecord(file* fp, string desc)
+{
+	return RecordOfLength(desc, FileSize(fp));
+}
+
+/*
+  Encrypt hdr into out the way it's stored on disk and return its byte
+  length, AAR_HDR_BYTES(hdr). Nothing past that length is written.
+*/
+size
+EncodeRecord(aar_archive* ar, aar_record_header hdr, u8* out)
 {
-	// We require 2 extra blocks for potentially padding the min
-	// section and the desc section.
-	u8 buf[AAR_RECORD_MAX + 2 * AAR_CHECKSUM_SIZE + 2 * AAR_BLOCK_SIZE];
+	u8 buf[AAR_HDR_BYTES_MAX];
 	size min_bytes = AAR_PADDING(AAR_RECORD_MIN + AAR_CHECKSUM_SIZE);
 	size desc_bytes = AAR_PADDING(hdr.desc_length + AAR_CHECKSUM_SIZE);
 	aar_checksum chk_hdr = AAR_CHECKSUM_INIT;
@@ -171,10 +443,12 @@ WriteRecord(file* fout, aar_record_header hdr, aes_key key)
 	}
 
 	{ // Compute checksums
-		chk_hdr = Checksum(chk_hdr, (u8*)&hdr.block_count, sizeof(hdr.block_count));
-		chk_hdr = Checksum(chk_hdr, (u8*)&hdr.block_offset, sizeof(hdr.block_offset));
-		chk_hdr = Checksum(chk_hdr, (u8*)&hdr.desc_length, sizeof(hdr.desc_length));
-		chk_desc = Checksum(chk_desc, (u8*)hdr.desc, hdr.desc_length);
+		aar_checksum_kind kind = ar->format.checksum;
+
+		chk_hdr = Checksum(kind, chk_hdr, (u8*)&hdr.block_count, sizeof(hdr.block_count));
+		chk_hdr = Checksum(kind, chk_hdr, (u8*)&hdr.block_offset, sizeof(hdr.block_offset));
+		chk_hdr = Checksum(kind, chk_hdr, (u8*)&hdr.desc_length, sizeof(hdr.desc_length));
+		chk_desc = Checksum(kind, chk_desc, (u8*)hdr.desc, hdr.desc_length);
 	}
 
 	ToDisk(&chk_hdr, sizeof(chk_hdr), 1);
@@ -201,49 +475,101 @@ WriteRecord(file* fout, aar_record_header hdr, aes_key key)
 		memcpy(p, &chk_hdr, AAR_CHECKSUM_SIZE);
 	}
 
-	EncryptBlocks(buf, AAR_BLOCKS(min_bytes + desc_bytes), key);
+	EncryptBlocks(buf, AAR_BLOCKS(min_bytes + desc_bytes), ar->cipher);
+	memcpy(out, buf, min_bytes + desc_bytes);
+
+	return min_bytes + desc_bytes;
+}
+
+void
+WriteRecord(aar_archive* ar, aar_record_header hdr)
+{
+	u8 buf[AAR_HDR_BYTES_MAX];
+	size n = EncodeRecord(ar, hdr, buf);
+
+	fwrite(buf, sizeof(u8), n, ar->fp);
+	fflush(ar->fp);
+}
+
+/*
+  Write hdr at offset without moving ar's position. Returns false if it
+  couldn't all be written. Unlike with fwrite(3), ferror(3) isn't set.
+*/
+bool
+WriteRecordAt(aar_archive* ar, aar_record_header hdr, size offset)
+{
+	u8 buf[AAR_HDR_BYTES_MAX];
+	size n = EncodeRecord(ar, hdr, buf);
+
+	return WriteAt(ar->fp, buf, n, offset) == n;
+}
 
-	fwrite(buf, sizeof(u8), min_bytes + desc_bytes, fout);
-	fflush(fout);
+/* Encrypt chk into buf as a checksum block. */
+void
+EncodeChecksum(aar_archive* ar, aar_checksum chk, u8 buf[AAR_PADDING(AAR_CHECKSUM_SIZE)])
+{
+	bzero(buf, AAR_PADDING(AAR_CHECKSUM_SIZE));
+	ToDisk(&chk, sizeof(chk), 1);
+	memcpy(buf, &chk, sizeof(chk));
+	EncryptBlocks(buf, AAR_BLOCKS(sizeof(chk)), ar->cipher);
 }
 
+/* Write chk as an encrypted checksum block at the position of ar->fp. */
 void
-IngestFile(file* fin, file* fout, aes_key key)
+WriteChecksum(aar_archive* ar, aar_checksum chk)
+{
+	u8 buf[AAR_PADDING(AAR_CHECKSUM_SIZE)];
+
+	EncodeChecksum(ar, chk, buf);
+	(void) fwrite(buf, sizeof(u8), sizeof(buf), ar->fp);
+	fflush(ar->fp);
+}
+
+/*
+  Encrypt the rest of fin into ar at its position, store the number of
+  bytes read in *length and return the data's checksum. fin may be a
+  pipe, in which case the whole IO buffer is used.
+*/
+aar_checksum
+IngestFile(file* fin, aar_archive* ar, size* length)
 {
 	size n;
-	size buf_size = AAR_IOBUF;
-	static u8 buf[AAR_IOBUF];
+	size buf_size;
+	size want = FileSize(fin);
 	aar_checksum chk = AAR_CHECKSUM_INIT;
 
-	bzero(buf, buf_size);
+	if (want == (size) -1) {
+		want = IoBufferMax(ar->iobuf);
+	}
+
+	u8* buf = (u8*) IoBuffer(ar->iobuf, want, &buf_size);
 
+	*length = 0;
 	while (n = fread(buf, sizeof(u8), buf_size, fin), n > 0) {
-		chk = Checksum(chk, buf, n);
 		size blocks = AAR_BLOCKS(n);
-		EncryptBlocks(buf, blocks, key);
-		fwrite(buf, sizeof(u8), blocks * AAR_BLOCK_SIZE, fout);
-		bzero(buf, buf_size);
+		bzero(buf + n, blocks * AAR_BLOCK_SIZE - n);
+		chk = EncryptChecksum(ar->format.checksum, chk, buf, n, ar->cipher, ar->jobs);
+		fwrite(buf, sizeof(u8), blocks * AAR_BLOCK_SIZE, ar->fp);
+		*length += n;
 	}
 
-	ToDisk(&chk, sizeof(chk), 1);
-	memcpy(buf, &chk, sizeof(chk));
-	EncryptBlocks(buf, AAR_BLOCKS(sizeof(chk)), key);
-	fwrite(buf, sizeof(u8), AAR_PADDING(sizeof(chk)), fout);
-	fflush(fout);
+	WriteChecksum(ar, chk);
+	return chk;
 }
 
+/*
+  Decode the record header at the start of in, of which n bytes were
+  read. Bytes past the header are ignored, and in is left alone.
+*/
 aar_record_header_ok
-ReadRecord(file* archive_file, aes_key key)
+DecodeRecord(aar_archive* ar, const u8* in, size n)
 {
 	aar_record_header hdr;
 	aar_record_header_ok result = {0};
 	
-	// Only one padding block is required here. We can ignore the
-	// padding at the end of desc.
-	u8 buf[AAR_RECORD_MAX + 2 * AAR_CHECKSUM_SIZE + AAR_BLOCK_SIZE];
+	u8 buf[AAR_HDR_BYTES_MAX];
 	u8* p = buf;
 
-	size pos = ftell(archive_file);
 	size min_bytes = AAR_PADDING(AAR_RECORD_MIN + AAR_CHECKSUM_SIZE);
 
 	aar_checksum chk_hdr = 0;
@@ -254,11 +580,11 @@ ReadRecord(file* archive_file, aes_key key)
 		bzero(buf, sizeof(buf));
 	}
 
-	// Read as much as possible. Garbage at the end will be ignored.
-	if (fread(buf, sizeof(u8), sizeof(buf), archive_file) < AAR_PADDING(AAR_RECORD_MIN + AAR_CHECKSUM_SIZE)) {
+	if (n < min_bytes) {
 		return result;
 	}
-	DecryptBlocks(buf, AAR_BLOCKS(min_bytes), key);
+	memcpy(buf, in, (n < sizeof(buf)) ? n : sizeof(buf));
+	DecryptBlocks(buf, AAR_BLOCKS(min_bytes), ar->cipher);
 
 	{ // Copy data into our record struct
 		memcpy(&hdr.block_count, p, sizeof(hdr.block_count));
@@ -284,16 +610,17 @@ ReadRecord(file* archive_file, aes_key key)
 	}
 
 	{ // Check for corruption before reading hdr.desc
-		aar_checksum _chk_hdr = Checksum(AAR_CHECKSUM_INIT, (u8*) &hdr.block_count, sizeof(hdr.block_count));
-		_chk_hdr = Checksum(_chk_hdr, (u8*) &hdr.block_offset, sizeof(hdr.block_offset));
-		_chk_hdr = Checksum(_chk_hdr, (u8*) &hdr.desc_length, sizeof(hdr.desc_length));
+		aar_checksum_kind kind = ar->format.checksum;
+		aar_checksum _chk_hdr = Checksum(kind, AAR_CHECKSUM_INIT, (u8*) &hdr.block_count, sizeof(hdr.block_count));
+		_chk_hdr = Checksum(kind, _chk_hdr, (u8*) &hdr.block_offset, sizeof(hdr.block_offset));
+		_chk_hdr = Checksum(kind, _chk_hdr, (u8*) &hdr.desc_length, sizeof(hdr.desc_length));
 
-		if (chk_hdr != _chk_hdr) {
+		if (chk_hdr != _chk_hdr || hdr.desc_length > AAR_DESC_MAX) {
 			return result;
 		}
 	}
 
-	DecryptBlocks(p, AAR_BLOCKS(hdr.desc_length + AAR_CHECKSUM_SIZE), key);
+	DecryptBlocks(p, AAR_BLOCKS(hdr.desc_length + AAR_CHECKSUM_SIZE), ar->cipher);
 	memcpy(&chk_desc, p + hdr.desc_length, AAR_CHECKSUM_SIZE);
 	FromDisk(&chk_desc, AAR_CHECKSUM_SIZE, 1);
 
@@ -302,220 +629,2026 @@ ReadRecord(file* archive_file, aes_key key)
 	memcpy(hdr.desc, p, hdr.desc_length);
 
 	{ // Check for corruption
-		aar_checksum _chk_desc = Checksum(AAR_CHECKSUM_INIT, hdr.desc, hdr.desc_length);
+		aar_checksum _chk_desc = Checksum(ar->format.checksum, AAR_CHECKSUM_INIT, hdr.desc, hdr.desc_length);
 
 		if (chk_desc != _chk_desc && hdr.desc_length != 0) {
 			return result;
 		}
 	}
 
-	// Set the cursor position as the end of record header/beginning of data
-	(void) fseek(archive_file, pos + AAR_HDR_BYTES(hdr), SEEK_SET);
-
 	result.ok = 1;
 	result.value = hdr;
 	return result;
 }
 
-bool
-SeekRecord(file* archive_file, size n, aes_key key)
+/* Read the record header at offset without moving ar's position. */
+aar_record_header_ok
+ReadRecordAt(aar_archive* ar, size offset)
 {
-	aar_record_header_ok hdr;
-
-	fseek(archive_file, AAR_FILE_HEADER_SIZE, SEEK_SET);
-	for (size i = 0; hdr = ReadRecord(archive_file, key), hdr.ok; i++) {
-		if (i == n) {
-			fseek(archive_file, -AAR_HDR_BYTES(hdr.value), SEEK_CUR);
-			return true;
-		}
-		fseek(archive_file, AAR_DATA_BYTES(hdr.value), SEEK_CUR);
-	}
+	u8 buf[AAR_HDR_BYTES_MAX];
 
-	return false;
+	return DecodeRecord(ar, buf, ReadAt(ar->fp, buf, sizeof(buf), offset));
 }
 
 /*
-  Encrypt a single file outside of an archive.
+  Read the record header at ar's position and leave the position at
+  the start of the record's data.
+*/
+aar_record_header_ok
+ReadRecord(aar_archive* ar)
+{
+	size pos = ftell(ar->fp);
+	aar_record_header_ok hdr = ReadRecordAt(ar, pos);
 
-  The file will become a record with desc length of 0.
-  
-  WARNING: This function uses a static buffer for IO. It's not thread
-  safe.
+	if (hdr.ok) {
+		(void) fseek(ar->fp, pos + AAR_HDR_BYTES(hdr.value), SEEK_SET);
+	}
+	return hdr;
+}
+
+/*
+  Give hdr the description of record n from ar's index, if it has one.
+  A rename in a log archive only changes the index.
 */
 void
-EncryptFile(file* fp, aes_key key)
+IndexDesc(aar_archive* ar, size n, aar_record_header* hdr)
 {
-	int n;
-	size buf_size = AAR_IOBUF;
-	static u8* buf[AAR_IOBUF];
-	aar_record_header hdr = NewRecord(fp, $("")); // TODO: Replace empty string with file name
-	aar_checksum chk = AAR_CHECKSUM_INIT;
+	if (ar->index.ok && n < ar->index.count) {
+		aar_index_entry* e = &ar->index.entries[n];
+		memcpy(hdr->desc, ar->index.descs + e->desc, e->desc_length);
+		hdr->desc_length = e->desc_length;
+	}
+}
 
-	bzero(buf, buf_size);
+/* Start walking ar's records. Call NextRecord() for the first one. */
+aar_record_iter
+IterRecords(aar_archive* ar)
+{
+	aar_record_iter it = {ar, 0, 0, 0, ar->start, false};
 
-	ShiftFileData(fp, AAR_PADDING(AAR_RECORD_MIN + AAR_CHECKSUM_SIZE), 0, FileSize(fp));
-	WriteRecord(fp, hdr, key);
-	fflush(fp);
+	return it;
+}
 
-	while (n = fread(buf, sizeof(u8), buf_size, fp), n > 0) {
-		chk = Checksum(chk, (byte*) buf, n);
-		(void) fseek(fp, -n, SEEK_CUR);
-		size blocks = AAR_BLOCKS(n);
-		EncryptBlocks((byte*)buf, blocks, key);
-		(void) fwrite(buf, sizeof(u8), blocks * AAR_BLOCK_SIZE, fp);
-		fflush(fp);
-		bzero(buf, buf_size);
+/*
+  Return the bytes at offset from it's read-ahead buffer, and store how
+  many there are in *n. The buffer is refilled from offset unless it
+  holds want bytes there, or everything up to the end of the file.
+*/
+static const u8*
+ReadAhead(aar_record_iter* it, size offset, size want, size* n)
+{
+	size end = it->ahead_offset + it->ahead_length;
+	bool eof = it->ahead_length < sizeof(it->ahead);
+
+	if (offset < it->ahead_offset || offset > end || (end - offset < want && !eof)) {
+		it->ahead_offset = offset;
+		it->ahead_length = ReadAt(it->ar->fp, it->ahead, sizeof(it->ahead), offset);
+		end = offset + it->ahead_length;
 	}
 
-	ToDisk(&chk, sizeof(chk), 1);
-	memcpy(buf, &chk, sizeof(chk));
-	EncryptBlocks(buf, AAR_BLOCKS(sizeof(chk)), key);
-	(void) fwrite(buf, sizeof(u8), AAR_PADDING(sizeof(chk)), fp);
-	fflush(fp);
+	*n = end - offset;
+	return it->ahead + (offset - it->ahead_offset);
 }
 
 /*
-  Decrypt a single file that doesn't belong to an archive. Such files
-  were encrypted by EncryptFile().
-
-  WARNING: This function uses a static buffer for IO. It's not thread
-  safe.
+  Copy len bytes at offset in it's archive to buf through the
+  read-ahead buffer. Returns false if the file ends first.
 */
-void
-DecryptFile(file* fp, aes_key key)
+bool
+IterRead(aar_record_iter* it, size offset, void* buf, size len)
 {
-	// TODO: Ensure this doesn't need better error checking.
-	int n;
-	size buf_size = AAR_IOBUF;
-	static u8* buf[AAR_IOBUF];
-
-	bzero(buf, buf_size);
+	size n;
+	const u8* p = ReadAhead(it, offset, len, &n);
 
-	if (FileSize(fp) < AAR_RECORD_MIN) {
-		Println$("Invalid file.");
-		return;
+	if (n < len) {
+		return ReadAt(it->ar->fp, buf, len, offset) == len;
 	}
+	memcpy(buf, p, len);
+	return true;
+}
 
-	aar_record_header_ok _hdr = ReadRecord(fp, key);
-	if (!_hdr.ok) {
-		Println$("Error: Not an AAR encrypted file.");
-		return;
-	}
+/*
+  Read the next record's header into it->hdr and the offset of its
+  data into it->data. The archive's position isn't used or moved.
+  Headers are read through it's read-ahead buffer. Returns false after
+  the last record, or at the first one that is corrupted, which also
+  sets it->corrupt. See WalkedAll().
+
+  With an index, only the records in it are visited, and setting
+  it->count skips straight to that record. Without one, log records
+  are skipped unless it->raw is set.
+*/
+bool
+NextRecord(aar_record_iter* it)
+{
+	aar_archive* ar = it->ar;
+	aar_record_header_ok hdr;
 
-	aar_record_header hdr = _hdr.value;
-	ShiftFileData(fp, -AAR_HDR_BYTES(hdr), 0, FileSize(fp));
-	rewind(fp);
+	do {
+		if (ar->index.ok) {
+			if (it->count >= ar->index.count) {
+				return false;
+			}
+			it->next = ar->index.entries[it->count].offset;
+		}
 
-	while (n = fread(buf, sizeof(u8), buf_size, fp), n > 0) {
-		(void) fseek(fp, -n, SEEK_CUR);
-		size blocks = AAR_BLOCKS(n);
-		DecryptBlocks((byte*)buf, blocks, key);
-		(void) fwrite(buf, sizeof(u8), blocks * AAR_BLOCK_SIZE, fp);
-		fflush(fp);
-		bzero(buf, buf_size);
-	}
+		size n;
+		const u8* p = ReadAhead(it, it->next, AAR_HDR_BYTES_MAX, &n);
+		if (hdr = DecodeRecord(ar, p, n), !hdr.ok) {
+			// Without an index the records end at the end of the
+			// file or at the old index. Anywhere else, a header
+			// is missing.
+			it->corrupt = ar->index.ok || (it->next != ar->end
+				&& (ar->format.index == 0 || it->next != ar->format.index));
+			return false;
+		}
 
-	// TODO: Check checksum.
+		it->offset = it->next;
+		it->data = it->offset + AAR_HDR_BYTES(hdr.value);
+		it->next = AlignRecord(ar, it->data + AAR_DATA_BYTES(hdr.value));
+	} while (AAR_RECORD_IS_LOG(hdr.value) && !it->raw && !ar->index.ok);
 
-	int fd = fileno(fp);
-	(void) ftruncate(fd, FileSize(fp) - hdr.block_offset - AAR_PADDING(AAR_CHECKSUM_SIZE));
-	fflush(fp);
+	it->hdr = hdr.value;
+	it->index = it->count++;
+	IndexDesc(ar, it->index, &it->hdr);
+	return true;
 }
 
-void
-ArchiveSplit(file* archive_file, size index, aes_key key)
+/*
+  Return true if it stopped after the last record. Otherwise the header
+  of record it->count is corrupted, so the records from there on can't
+  be found. That's printed unless the archive is quiet.
+*/
+bool
+WalkedAll(aar_record_iter* it)
 {
-	aar_record_header_ok _hdr;
-	if (!SeekRecord(archive_file, index, mem.key.raw)) {
-		Println$("Warning: Record %d doesn't exist.", index);
-		return;
+	if (it->corrupt && !it->ar->quiet) {
+		Println$("Error! The header of record %d is corrupted.", it->count);
 	}
+	return !it->corrupt;
+}
 
-	if (_hdr = ReadRecord(archive_file, mem.key.raw), !_hdr.ok) {
-		Println$("Record %d is corrupted.", index);
-		return;
+/*
+  Find record n and store its header in *hdr and the byte offsets of
+  the header and its data in *offset and *data. With an index, that's
+  a single read. Returns false if there's no such record, or if a
+  corrupted header comes first.
+*/
+bool
+FindRecord(aar_archive* ar, size n, aar_record_header* hdr, size* offset, size* data)
+{
+	aar_record_iter it = IterRecords(ar);
+
+	if (ar->index.ok) {
+		it.count = (n < ar->index.count) ? n : ar->index.count;
 	}
 
-	string desc = $$$(_hdr.value.desc, _hdr.value.desc_length);
-	file* out = OpenFile(desc, "w+");
-	if (!out) {
-		Println$("Failed to extract record %d as '%s'", index, desc);
-		return;
+	while (NextRecord(&it)) {
+		if (it.index == n) {
+			*hdr = it.hdr;
+			*offset = it.offset;
+			*data = it.data;
+			return true;
+		}
 	}
 
-	Println$("Splitting record %d as %s", index, desc);
+	(void) WalkedAll(&it);
+	return false;
+}
 
-	u8 buf[AAR_BLOCK_SIZE];
-	WriteRecord(out, _hdr.value, mem.key.raw);
-	for (size i = 0; i < _hdr.value.block_count + 1; i++) {
-		bzero(buf, AAR_BLOCK_SIZE);
-		(void) fread(buf, sizeof(u8), AAR_BLOCK_SIZE, archive_file);
-		(void) fwrite(buf, sizeof(u8), AAR_BLOCK_SIZE, out);
-		fflush(out);
-	}
-	fclose(out);
+/*
+  Read the checksum block in buf. buf is left alone.
+*/
+aar_checksum
+DecodeChecksum(aar_archive* ar, u8 buf[AAR_PADDING(AAR_CHECKSUM_SIZE)])
+{
+	u8 tmp[AAR_PADDING(AAR_CHECKSUM_SIZE)];
+	aar_checksum chk;
+
+	memcpy(tmp, buf, sizeof(tmp));
+	DecryptBlocks(tmp, AAR_BLOCKS(sizeof(chk)), ar->cipher);
+	memcpy(&chk, tmp, sizeof(chk));
+	FromDisk(&chk, sizeof(chk), 1);
+
+	return chk;
 }
 
+/* Wipe and free idx, leaving it empty. */
 void
-ArchiveExtract(file* archive_file, size index, aes_key key)
+IndexFree(aar_index* idx)
 {
-	aar_record_header_ok _hdr;
-	if (!SeekRecord(archive_file, index, mem.key.raw)) {
-		Println$("Warning: Record %d doesn't exist.", index);
-		return;
+	if (idx->descs) {
+		bzero(idx->descs, idx->descs_capacity);
 	}
+	free(idx->entries);
+	free(idx->descs);
+	bzero(idx, sizeof(aar_index));
+}
 
-	if (_hdr = ReadRecord(archive_file, mem.key.raw), !_hdr.ok) {
-		Println$("Record %d is corrupted.", index);
-		return;
-	}
+/*
+  Make room in idx for n more entries and desc_length more bytes of
+  descriptions. If memory runs out, idx is dropped and false returned.
+  Records are then found by reading the archive, and the index on disk
+  no longer matches and is rebuilt the next time it's needed.
+*/
+static bool
+IndexReserve(aar_index* idx, size n, size desc_length)
+{
+	if (idx->count + n > idx->capacity) {
+		size capacity = (idx->capacity > 0) ? idx->capacity : 64;
+		while (capacity < idx->count + n) {
+			capacity *= 2;
+		}
 
-	string desc = $$$(_hdr.value.desc, _hdr.value.desc_length);
-	file* out = OpenFile(desc, "w+");
-	if (!out) {
-		Println$("Failed to extract record %d as '%s'", index, desc);
-		return;
+		aar_index_entry* entries = realloc(idx->entries, capacity * sizeof(aar_index_entry));
+		if (!entries) {
+			IndexFree(idx);
+			return false;
+		}
+		idx->entries = entries;
+		idx->capacity = capacity;
 	}
 
-	Println$("Extracting record %d as %s", index, desc);
+	if (idx->descs_length + desc_length > idx->descs_capacity) {
+		size capacity = (idx->descs_capacity > 0) ? idx->descs_capacity : KiloBytes(4);
+		while (capacity < idx->descs_length + desc_length) {
+			capacity *= 2;
+		}
 
-	// TODO: Don't copy the record without
-	// decrypting. We're passing over the data
-	// twice...
-	u8 buf[AAR_BLOCK_SIZE];
-	WriteRecord(out, _hdr.value, mem.key.raw);
-	for (size i = 0; i < _hdr.value.block_count + 1; i++) {
-		bzero(buf, AAR_BLOCK_SIZE);
-		(void) fread(buf, sizeof(u8), AAR_BLOCK_SIZE, archive_file);
-		(void) fwrite(buf, sizeof(u8), AAR_BLOCK_SIZE, out);
-		fflush(out);
+		u8* descs = realloc(idx->descs, capacity);
+		if (!descs) {
+			IndexFree(idx);
+			return false;
+		}
+		idx->descs = descs;
+		idx->descs_capacity = capacity;
 	}
 
-	// TODO: This is a waste of time. Just decrypt
-	// data as writing it out.
-	rewind(out);
-	DecryptFile(out, mem.key.raw);
-	fclose(out);
+	return true;
 }
 
-void
-Usage(string cmd)
+/*
+  Store hdr in entry n. Room for the description must be reserved.
+  An old description is left where it is.
+*/
+static void
+IndexSetRecord(aar_index* idx, size n, aar_record_header hdr)
 {
-	Println$("Usage:  %s [OPTIONS] COMMAND\n\n"
+	aar_index_entry* e = &idx->entries[n];
 
-		 "Options:\n"
-		 "  -k  --key=KEY       AES key encoded with base64.\n"
-		 "  -a  --archive=FILE  AAR archive filename.\n\n"
+	e->block_count = hdr.block_count;
+	e->block_offset = hdr.block_offset;
+	e->desc_length = hdr.desc_length;
+	e->desc = idx->descs_length;
 
-		 "Commands:\n"
-		 "  new          Generate a random AES-256 bit key.\n"
-		 "  list         List all file names.\n"
-		 "  add          Add files to an archive.\n"
-		 "  delete       Delete a record.\n"
-		 "  extract      Extract a single record.\n"
-		 "  extract-all  Extract all records.\n"
-		 "  split        Divide the archive's records into individually encrypted files.\n"
-		 "  rename       Change the description.\n"
+	memcpy(idx->descs + idx->descs_length, hdr.desc, hdr.desc_length);
+	idx->descs_length += hdr.desc_length;
+}
+
+/* Move the records from entry n onwards by delta bytes. */
+static void
+IndexShift(aar_index* idx, size n, i64 delta)
+{
+	for (size i = n; i < idx->count; i++) {
+		idx->entries[i].offset += delta;
+	}
+}
+
+/* Add the record at offset, whose data has checksum chk, to the end of idx. */
+void
+IndexAppend(aar_index* idx, size offset, aar_record_header hdr, aar_checksum chk)
+{
+	if (!IndexReserve(idx, 1, hdr.desc_length)) {
+		return;
+	}
+	idx->entries[idx->count].offset = offset;
+	idx->entries[idx->count].checksum = chk;
+	IndexSetRecord(idx, idx->count, hdr);
+	idx->count++;
+	idx->dirty = true;
+}
+
+/* Drop entry n. The records after it moved back by length bytes. */
+void
+IndexRemove(aar_index* idx, size n, size length)
+{
+	memmove(idx->entries + n, idx->entries + n + 1, (idx->count - n - 1) * sizeof(aar_index_entry));
+	idx->count--;
+	IndexShift(idx, n, -(i64) length);
+	idx->dirty = true;
+}
+
+/*
+  Drop the count entries listed in n, which is sorted. Entry n[i]'s
+  record was lengths[i] bytes long, and everything after it moved back
+  by that much. All of it is done in one pass over idx.
+*/
+void
+IndexRemoveRecords(aar_index* idx, size* n, size* lengths, size count)
+{
+	size kept = n[0];
+	size shift = 0;
+
+	for (size i = n[0], k = 0; i < idx->count; i++) {
+		if (k < count && n[k] == i) {
+			shift += lengths[k++];
+			continue;
+		}
+		idx->entries[kept] = idx->entries[i];
+		idx->entries[kept++].offset -= shift;
+	}
+
+	idx->count = kept;
+	idx->dirty = true;
+}
+
+/* Give entry n the header hdr. The records after it moved by delta bytes. */
+void
+IndexRename(aar_index* idx, size n, aar_record_header hdr, i64 delta)
+{
+	if (!IndexReserve(idx, 0, hdr.desc_length)) {
+		return;
+	}
+	IndexSetRecord(idx, n, hdr);
+	IndexShift(idx, n + 1, delta);
+	idx->dirty = true;
+}
+
+/* Find the entry of the record at offset. Returns idx->count if there's none. */
+size
+IndexFind(aar_index* idx, size offset)
+{
+	size lo = 0;
+	size hi = idx->count;
+
+	while (lo < hi) {
+		size mid = lo + (hi - lo) / 2;
+		if (idx->entries[mid].offset < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	return (lo < idx->count && idx->entries[lo].offset == offset) ? lo : idx->count;
+}
+
+/*
+  Read the record index that ar->format points to into ar->index and
+  set ar->end. Returns false, with the index left empty, if there's no
+  index or it doesn't match the archive.
+*/
+bool
+LoadIndex(aar_archive* ar)
+{
+	size offset = ar->format.index;
+	size length = ar->format.index_length;
+	u8* buf;
+	u8* p;
+	u64 count;
+	aar_checksum chk, _chk;
+
+	IndexFree(&ar->index);
+
+	if (offset < ar->start || length < AAR_INDEX_HEADER_SIZE || length % AAR_BLOCK_SIZE != 0
+	    || offset + length != FileSize(ar->fp)) {
+		return false;
+	}
+
+	if (buf = malloc(length), !buf) {
+		return false;
+	}
+
+	(void) fseek(ar->fp, offset, SEEK_SET);
+	if (fread(buf, sizeof(u8), length, ar->fp) < length) {
+		free(buf);
+		return false;
+	}
+	DecryptBlocksParallel(buf, AAR_BLOCKS(length), ar->cipher, ar->jobs);
+
+	memcpy(&count, buf, sizeof(count));
+	memcpy(&chk, buf + sizeof(count), sizeof(chk));
+	FromDisk(&chk, sizeof(chk), 1);
+
+	_chk = Checksum(ar->format.checksum, AAR_CHECKSUM_INIT, buf, sizeof(count));
+	_chk = Checksum(ar->format.checksum, _chk, buf + AAR_INDEX_HEADER_SIZE, length - AAR_INDEX_HEADER_SIZE);
+	FromDisk(&count, sizeof(count), 1);
+
+	p = buf + AAR_INDEX_HEADER_SIZE;
+	for (u64 i = 0; chk == _chk && i < count; i++) {
+		aar_record_header hdr;
+		aar_checksum data_chk;
+		u64 rec_offset;
+		u32 desc_length;
+
+		if (buf + length - p < AAR_INDEX_ENTRY_MIN) {
+			break;
+		}
+
+		memcpy(&rec_offset, p, sizeof(rec_offset));
+		memcpy(&hdr.block_count, p + 8, sizeof(hdr.block_count));
+		memcpy(&hdr.block_offset, p + 16, sizeof(hdr.block_offset));
+		memcpy(&desc_length, p + 24, sizeof(desc_length));
+		memcpy(&data_chk, p + 28, sizeof(data_chk));
+		FromDisk(&rec_offset, sizeof(rec_offset), 1);
+		FromDisk(&hdr.block_count, sizeof(hdr.block_count), 1);
+		FromDisk(&hdr.block_offset, sizeof(hdr.block_offset), 1);
+		FromDisk(&desc_length, sizeof(desc_length), 1);
+		FromDisk(&data_chk, sizeof(data_chk), 1);
+
+		if (desc_length > AAR_DESC_MAX || buf + length - p < AAR_INDEX_ENTRY_SIZE(desc_length)
+		    || rec_offset < ar->start || rec_offset >= offset) {
+			break;
+		}
+
+		hdr.desc_length = desc_length;
+		memcpy(hdr.desc, p + AAR_INDEX_ENTRY_MIN, desc_length);
+		IndexAppend(&ar->index, rec_offset, hdr, data_chk);
+		p += AAR_INDEX_ENTRY_SIZE(desc_length);
+	}
+
+	size used = p - buf;
+	bzero(buf, length);
+	free(buf);
+
+	if (chk != _chk || ar->index.count != count || used != length) {
+		IndexFree(&ar->index);
+		return false;
+	}
+
+	ar->end = offset;
+	ar->index.ok = true;
+	ar->index.dirty = false;
+	return true;
+}
+
+/*
+  Decode the data of a log record, its data block and checksum block in
+  buf, into the offset of the record it refers to. buf is decrypted in
+  place. Returns false if the data is corrupted.
+*/
+bool
+DecodeLogTarget(aar_archive* ar, u8 buf[AAR_BLOCK_SIZE + AAR_PADDING(AAR_CHECKSUM_SIZE)], size* target)
+{
+	u64 offset;
+	aar_checksum chk = DecryptChecksum(ar->format.checksum, AAR_CHECKSUM_INIT, buf, AAR_BLOCK_SIZE, ar->cipher, 1);
+	if (DecodeChecksum(ar, buf + AAR_BLOCK_SIZE) != chk) {
+		return false;
+	}
+
+	memcpy(&offset, buf, sizeof(offset));
+	FromDisk(&offset, sizeof(offset), 1);
+	*target = offset;
+	return true;
+}
+
+/*
+  Append a log record of kind AAR_RECORD_DELETE or AAR_RECORD_RENAME
+  to ar at ar->end. It refers to the record whose header is at target,
+  and carries hdr's description.
+*/
+void
+AppendLogRecord(aar_archive* ar, u64 kind, size target, aar_record_header hdr)
+{
+	u8 buf[AAR_BLOCK_SIZE];
+	u64 offset = target;
+
+	hdr.block_count = 1;
+	hdr.block_offset = kind;
+
+	bzero(buf, sizeof(buf));
+	ToDisk(&offset, sizeof(offset), 1);
+	memcpy(buf, &offset, sizeof(offset));
+	aar_checksum chk = EncryptChecksum(ar->format.checksum, AAR_CHECKSUM_INIT, buf, sizeof(buf), ar->cipher, 1);
+
+	(void) fseek(ar->fp, ar->end, SEEK_SET);
+	WriteRecord(ar, hdr);
+	(void) fwrite(buf, sizeof(u8), sizeof(buf), ar->fp);
+	WriteChecksum(ar, chk);
+	PadRecord(ar);
+	ar->end = ftell(ar->fp);
+}
+
+/*
+  Build ar->index by reading every record header and set ar->end.
+  The log records of a log archive are applied as they're read.
+  The records have to run up to the old index, if there was one, or to
+  the end of the file. Anything after that is what's left of the old
+  index. Returns false, with the index left empty, otherwise since the
+  records after the first unreadable one would be lost.
+*/
+bool
+ScanIndex(aar_archive* ar)
+{
+	u8 tail[AAR_BLOCK_SIZE + AAR_PADDING(AAR_CHECKSUM_SIZE)];
+	size fsize = FileSize(ar->fp);
+	size offset = ar->start;
+
+	IndexFree(&ar->index);
+
+	aar_record_iter it = IterRecords(ar);
+	it.raw = true;
+	while (offset < fsize && NextRecord(&it)) {
+		if (AAR_RECORD_IS_LOG(it.hdr)) {
+			size target, n;
+			if (!IterRead(&it, it.data, tail, sizeof(tail)) || !DecodeLogTarget(ar, tail, &target)) {
+				break;
+			}
+
+			// A record that's already gone is left alone.
+			n = IndexFind(&ar->index, target);
+			if (n < ar->index.count && it.hdr.block_offset == AAR_RECORD_DELETE) {
+				IndexRemove(&ar->index, n, 0);
+			} else if (n < ar->index.count && it.hdr.block_offset == AAR_RECORD_RENAME) {
+				it.hdr.block_count = ar->index.entries[n].block_count;
+				it.hdr.block_offset = ar->index.entries[n].block_offset;
+				IndexRename(&ar->index, n, it.hdr, 0);
+			}
+
+			offset = it.next;
+			continue;
+		}
+
+		if (!IterRead(&it, it.data + it.hdr.block_count * AAR_BLOCK_SIZE, tail, AAR_PADDING(AAR_CHECKSUM_SIZE))) {
+			break;
+		}
+
+		IndexAppend(&ar->index, offset, it.hdr, DecodeChecksum(ar, tail));
+		offset = it.next;
+	}
+
+	if (offset < fsize && (ar->format.index == 0 || offset < ar->format.index)) {
+		IndexFree(&ar->index);
+		return false;
+	}
+
+	ar->end = offset;
+	ar->index.ok = true;
+	ar->index.dirty = true;
+	return true;
+}
+
+/*
+  Write ar->index at ar->end, cut the file off after it and point the
+  format block at it. Only archives have an index, so the format block
+  is always right after the key.
+*/
+bool
+WriteIndex(aar_archive* ar)
+{
+	aar_index* idx = &ar->index;
+	size length = AAR_INDEX_HEADER_SIZE;
+	u8 format[AAR_FORMAT_SIZE];
+	u8* buf;
+	u8* p;
+	bool ok;
+
+	for (size i = 0; i < idx->count; i++) {
+		length += AAR_INDEX_ENTRY_SIZE(idx->entries[i].desc_length);
+	}
+
+	if (buf = malloc(length), !buf) {
+		return false;
+	}
+	bzero(buf, length);
+
+	p = buf + AAR_INDEX_HEADER_SIZE;
+	for (size i = 0; i < idx->count; i++) {
+		aar_index_entry* e = &idx->entries[i];
+		u64 rec_offset = e->offset;
+		u64 block_count = e->block_count;
+		u64 block_offset = e->block_offset;
+		u32 desc_length = e->desc_length;
+		aar_checksum chk = e->checksum;
+
+		ToDisk(&rec_offset, sizeof(rec_offset), 1);
+		ToDisk(&block_count, sizeof(block_count), 1);
+		ToDisk(&block_offset, sizeof(block_offset), 1);
+		ToDisk(&desc_length, sizeof(desc_length), 1);
+		ToDisk(&chk, sizeof(chk), 1);
+		memcpy(p, &rec_offset, sizeof(rec_offset));
+		memcpy(p + 8, &block_count, sizeof(block_count));
+		memcpy(p + 16, &block_offset, sizeof(block_offset));
+		memcpy(p + 24, &desc_length, sizeof(desc_length));
+		memcpy(p + 28, &chk, sizeof(chk));
+		memcpy(p + AAR_INDEX_ENTRY_MIN, idx->descs + e->desc, e->desc_length);
+		p += AAR_INDEX_ENTRY_SIZE(e->desc_length);
+	}
+
+	{ // Count and checksum
+		u64 count = idx->count;
+		aar_checksum chk;
+
+		ToDisk(&count, sizeof(count), 1);
+		memcpy(buf, &count, sizeof(count));
+		chk = Checksum(ar->format.checksum, AAR_CHECKSUM_INIT, buf, sizeof(count));
+		chk = Checksum(ar->format.checksum, chk, buf + AAR_INDEX_HEADER_SIZE, length - AAR_INDEX_HEADER_SIZE);
+		ToDisk(&chk, sizeof(chk), 1);
+		memcpy(buf + sizeof(count), &chk, sizeof(chk));
+	}
+
+	EncryptBlocksParallel(buf, AAR_BLOCKS(length), ar->cipher, ar->jobs);
+
+	(void) fseek(ar->fp, ar->end, SEEK_SET);
+	ok = fwrite(buf, sizeof(u8), length, ar->fp) == length;
+	fflush(ar->fp);
+	ok = ok && TruncateFile(ar->fp, ar->end + length);
+	free(buf);
+
+	if (!ok) {
+		return false;
+	}
+
+	ar->format.index = ar->end;
+	ar->format.index_length = length;
+	EncodeFormat(ar, format);
+	(void) fseek(ar->fp, AAR_FILE_HEADER_SIZE, SEEK_SET);
+	ok = fwrite(format, sizeof(u8), AAR_FORMAT_SIZE, ar->fp) == AAR_FORMAT_SIZE;
+	fflush(ar->fp);
+
+	idx->dirty = !ok;
+	return ok;
+}
+
+/* Get ar->index ready for a command that changes records. */
+void
+PrepareIndex(aar_archive* ar)
+{
+	if (HasFormatBlock(ar) && !ar->index.ok) {
+		(void) ScanIndex(ar);
+	}
+}
+
+/*
+  Write ar->index if it changed, then close and forget ar. Returns
+  false if the index couldn't be written or the file closed.
+*/
+bool
+CloseArchive(aar_archive* ar)
+{
+	bool ok = true;
+
+	if (ar->index.dirty && !WriteIndex(ar)) {
+		if (!ar->quiet) {
+			Println$("Warning: Failed to write the record index.");
+		}
+		ok = false;
+	}
+	IndexFree(&ar->index);
+	return fclose_safe(ar->fp) == 0 && ok;
+}
+
+/*
+  Open the archive at path and get it ready to work on its records.
+  ar->cipher must be set up with key, and ar->iobuf, ar->jobs and
+  ar->quiet set. Returns why it couldn't be opened, with ar closed
+  again, or AAR_FILE_OK.
+*/
+aar_file_status
+OpenArchive(aar_archive* ar, string path, aes_key key)
+{
+	aar_file_status status = AAR_FILE_OK;
+
+	if (ar->fp = ArchiveOpen(path), !ar->fp) {
+		if (!ar->quiet) {
+			Println$("Failed to open archive file.");
+		}
+		return AAR_FILE_UNOPENED;
+	}
+
+	if (!ArchiveValidate(ar->fp, key, ar->cipher).ok) {
+		if (!ar->quiet) {
+			Println$("Key doesn't match archive's key.");
+		}
+		status = AAR_FILE_WRONG_KEY;
+	} else if (!ReadFormat(ar)) {
+		if (!ar->quiet) {
+			Println$("Unsupported archive format.");
+		}
+		status = AAR_FILE_UNSUPPORTED;
+	}
+
+	if (status != AAR_FILE_OK) {
+		(void) CloseArchive(ar);
+		ar->fp = NULL;
+		return status;
+	}
+
+	ar->end = FileSize(ar->fp);
+	if (ar->format.index > 0 && !LoadIndex(ar) && !ar->quiet) {
+		Println$("Warning: The record index doesn't match the archive. Reading every record instead.");
+	}
+
+	// A log archive's records only make sense with the log applied.
+	if (ar->format.log && !ar->index.ok) {
+		if (!ScanIndex(ar)) {
+			if (!ar->quiet) {
+				Println$("Error! The archive's log is corrupted.");
+			}
+			(void) CloseArchive(ar);
+			ar->fp = NULL;
+			return AAR_FILE_CORRUPT;
+		}
+		ar->index.dirty = false;
+	}
+
+	return AAR_FILE_OK;
+}
+
+#ifndef AAR_NO_MMAP
+/*
+  Bytes EncryptFileMapped() and DecryptFileMapped() handle at a time
+  with jobs threads. Each slice gets its own thread, so the data stays
+  in cache between being moved and being encrypted.
+*/
+static size
+MappedChunk(size jobs)
+{
+	size chunk = jobs * AAR_ENGINE_SLICE;
+
+	if (chunk < AAR_PADDING(AAR_HDR_BYTES_MAX)) {
+		chunk = AAR_PADDING(AAR_HDR_BYTES_MAX);
+	}
+	return chunk;
+}
+
+/*
+  EncryptFile() through a memory map of the file. The file is grown to
+  its encrypted size, then the plaintext is moved up to make room for
+  the header and encrypted one chunk at a time on the way, with jobs
+  threads. Returns false, with the file untouched, if it can't be
+  mapped. Nothing is shared, so files can be encrypted at once.
+*/
+static bool
+EncryptFileMapped(aar_archive* ar, aar_record_header hdr, size jobs)
+{
+	u8 carry[AAR_HDR_BYTES_MAX];
+	u8 next[AAR_HDR_BYTES_MAX];
+	size length = FileSize(ar->fp);
+	size hdr_bytes = AAR_HDR_BYTES(hdr);
+	size total = hdr_bytes + AAR_DATA_BYTES(hdr);
+	size chunk = MappedChunk(jobs);
+	aar_checksum chk = AAR_CHECKSUM_INIT;
+	byte* map;
+
+	if (!TruncateFile(ar->fp, total)) {
+		return false;
+	}
+
+	if (map = MapFile(ar->fp, total), !map) {
+		(void) TruncateFile(ar->fp, length);
+		return false;
+	}
+
+	// Moving the data up overwrites the start of the following
+	// chunk, so those bytes are carried over in carry.
+	memcpy(carry, map, (length < hdr_bytes) ? length : hdr_bytes);
+
+	for (size off = 0; off < length; off += chunk) {
+		size n = length - off;
+		if (n > chunk) {
+			n = chunk;
+		}
+
+		if (n > hdr_bytes) {
+			size rest = length - off - n;
+			if (rest > hdr_bytes) {
+				rest = hdr_bytes;
+			}
+			memcpy(next, map + off + n, rest);
+			memmove(map + off + 2 * hdr_bytes, map + off + hdr_bytes, n - hdr_bytes);
+			memcpy(map + off + hdr_bytes, carry, hdr_bytes);
+			memcpy(carry, next, rest);
+		} else {
+			memcpy(map + off + hdr_bytes, carry, n);
+		}
+
+		// The padding after the last byte lies past the old end of
+		// the file, so it's already zero.
+		chk = EncryptChecksum(ar->format.checksum, chk, map + off + hdr_bytes, n, ar->cipher, jobs);
+	}
+
+	(void) EncodeRecord(ar, hdr, (u8*) map);
+	EncodeChecksum(ar, chk, (u8*) map + hdr_bytes + hdr.block_count * AAR_BLOCK_SIZE);
+
+	bzero(carry, sizeof(carry));
+	bzero(next, sizeof(next));
+	UnmapFile(map, total);
+	return true;
+}
+
+/*
+  DecryptFile() through a memory map of the file. Each chunk is
+  decrypted where it lies, with jobs threads, and then moved down over
+  the header. The file position must be at the start of the record's
+  data. Returns AAR_FILE_UNMAPPED, with the file untouched, if it
+  can't be mapped. Like EncryptFileMapped(), nothing is shared.
+*/
+static aar_file_status
+DecryptFileMapped(aar_archive* ar, aar_record_header hdr, size jobs)
+{
+	size start = ftell(ar->fp);
+	size length = FileSize(ar->fp);
+	size data = hdr.block_count * AAR_BLOCK_SIZE;
+	size plain = data - hdr.block_offset;
+	size chunk = MappedChunk(jobs);
+	aar_checksum chk = AAR_CHECKSUM_INIT;
+	aar_file_status status = AAR_FILE_OK;
+	byte* map;
+
+	// Leave truncated files to the stdio path.
+	if (length < start + AAR_DATA_BYTES(hdr)) {
+		return AAR_FILE_UNMAPPED;
+	}
+
+	if (map = MapFile(ar->fp, length), !map) {
+		return AAR_FILE_UNMAPPED;
+	}
+
+	for (size off = 0; off < data; off += chunk) {
+		size n = data - off;
+		if (n > chunk) {
+			n = chunk;
+		}
+		if (n > plain - off) {
+			n = plain - off;
+		}
+
+		chk = DecryptChecksum(ar->format.checksum, chk, map + start + off, n, ar->cipher, jobs);
+		memmove(map + off, map + start + off, n);
+	}
+
+	if (DecodeChecksum(ar, (u8*) map + start + data) != chk) {
+		status = AAR_FILE_CORRUPT;
+	}
+
+	UnmapFile(map, length);
+	(void) TruncateFile(ar->fp, plain);
+	return status;
+}
+#endif
+
+/*
+  Encrypt a single file outside of an archive.
+
+  The file will become a record with desc length of 0. It's written in
+  the legacy format, without a format block, so older versions of aar
+  can still decrypt it. jobs threads encrypt its blocks.
+
+  A file that can't be memory mapped goes through iobuf. When iobuf is
+  NULL it's left untouched and AAR_FILE_UNMAPPED is returned instead,
+  so that files can be encrypted on many threads at once.
+*/
+aar_file_status
+EncryptFile(file* fp, aar_cipher* cipher, size jobs, aar_iobuf* iobuf)
+{
+	int n;
+	size buf_size;
+	u8* buf;
+	aar_record_header hdr = NewRecord(fp, $("")); // TODO: Replace empty string with file name
+	aar_checksum chk = AAR_CHECKSUM_INIT;
+	aar_archive ar = {fp, cipher, {AAR_CHECKSUM_BSD}, 0};
+
+	ar.iobuf = iobuf;
+	ar.jobs = jobs;
+
+#ifndef AAR_NO_MMAP
+	if (EncryptFileMapped(&ar, hdr, jobs)) {
+		return AAR_FILE_OK;
+	}
+#endif
+	if (!iobuf) {
+		return AAR_FILE_UNMAPPED;
+	}
+
+	if (FileSize(fp) > 0) {
+		(void) ShiftFileData(fp, iobuf, AAR_PADDING(AAR_RECORD_MIN + AAR_CHECKSUM_SIZE), 0, FileSize(fp));
+	}
+	WriteRecord(&ar, hdr);
+	fflush(fp);
+
+	buf = (u8*) IoBuffer(iobuf, hdr.block_count * AAR_BLOCK_SIZE, &buf_size);
+	while (n = fread(buf, sizeof(u8), buf_size, fp), n > 0) {
+		(void) fseek(fp, -n, SEEK_CUR);
+		size blocks = AAR_BLOCKS(n);
+		bzero(buf + n, blocks * AAR_BLOCK_SIZE - n);
+		chk = EncryptChecksum(ar.format.checksum, chk, buf, n, cipher, jobs);
+		(void) fwrite(buf, sizeof(u8), blocks * AAR_BLOCK_SIZE, fp);
+		fflush(fp);
+	}
+
+	WriteChecksum(&ar, chk);
+	return AAR_FILE_OK;
+}
+
+/*
+  Decrypt a single file that doesn't belong to an archive. Such files
+  were encrypted by EncryptFile(), or split out of an archive. jobs
+  and iobuf are as for EncryptFile().
+*/
+aar_file_status
+DecryptFile(file* fp, aar_cipher* cipher, size jobs, aar_iobuf* iobuf)
+{
+	// TODO: Ensure this doesn't need better error checking.
+	int n;
+	size buf_size;
+	u8* buf;
+	aar_archive ar = {fp, cipher};
+	aar_file_status status = AAR_FILE_OK;
+
+	ar.iobuf = iobuf;
+	ar.jobs = jobs;
+
+	if (FileSize(fp) < AAR_RECORD_MIN) {
+		return AAR_FILE_INVALID;
+	}
+
+	if (!ReadFormat(&ar)) {
+		return AAR_FILE_UNSUPPORTED;
+	}
+
+	aar_record_header_ok _hdr = ReadRecord(&ar);
+	if (!_hdr.ok) {
+		return AAR_FILE_NOT_AAR;
+	}
+
+	aar_record_header hdr = _hdr.value;
+
+#ifndef AAR_NO_MMAP
+	if (status = DecryptFileMapped(&ar, hdr, jobs), status != AAR_FILE_UNMAPPED) {
+		return status;
+	}
+	status = AAR_FILE_OK;
+#endif
+	if (!iobuf) {
+		return AAR_FILE_UNMAPPED;
+	}
+
+	(void) ShiftFileData(fp, iobuf, -(ar.start + AAR_HDR_BYTES(hdr)), 0, FileSize(fp));
+	rewind(fp);
+
+	size left = hdr.block_count * AAR_BLOCK_SIZE;
+	size plain = left - hdr.block_offset;
+	aar_checksum chk = AAR_CHECKSUM_INIT;
+
+	buf = (u8*) IoBuffer(iobuf, left, &buf_size);
+
+	while (left > 0 && (n = fread(buf, sizeof(u8), (left < buf_size) ? left : buf_size, fp), n > 0)) {
+		size len = (plain < n) ? plain : n;
+		(void) fseek(fp, -n, SEEK_CUR);
+		size blocks = AAR_BLOCKS(n);
+		chk = DecryptChecksum(ar.format.checksum, chk, buf, len, cipher, jobs);
+		(void) fwrite(buf, sizeof(u8), blocks * AAR_BLOCK_SIZE, fp);
+		fflush(fp);
+		left -= n;
+		plain -= len;
+	}
+
+	{ // Compare against the checksum block after the data
+		u8 tail[AAR_PADDING(AAR_CHECKSUM_SIZE)];
+
+		(void) fseek(fp, hdr.block_count * AAR_BLOCK_SIZE, SEEK_SET);
+		if (fread(tail, sizeof(u8), sizeof(tail), fp) < sizeof(tail)) {
+			status = AAR_FILE_NO_CHECKSUM;
+		} else if (DecodeChecksum(&ar, tail) != chk) {
+			status = AAR_FILE_CORRUPT;
+		}
+	}
+
+	int fd = fileno(fp);
+	(void) ftruncate(fd, FileSize(fp) - hdr.block_offset - AAR_PADDING(AAR_CHECKSUM_SIZE));
+	fflush(fp);
+	return status;
+}
+
+/* Return the message for a file that didn't come out AAR_FILE_OK. */
+string
+FileStatusMessage(aar_file_status status)
+{
+	switch (status) {
+	case AAR_FILE_UNOPENED:    return $("Failed to open the file.");
+	case AAR_FILE_WRONG_KEY:   return $("Key doesn't match archive's key.");
+	case AAR_FILE_INVALID:     return $("Invalid file.");
+	case AAR_FILE_UNSUPPORTED: return $("Error: Unsupported file format.");
+	case AAR_FILE_NOT_AAR:     return $("Error: Not an AAR encrypted file.");
+	case AAR_FILE_NO_CHECKSUM: return $("Warning: The checksum is missing.");
+	case AAR_FILE_CORRUPT:     return $("Warning: Checksum mismatch. The data is corrupted.");
+	case AAR_FILE_UNWRITTEN:   return $("Failed to write the data.");
+	case AAR_FILE_NO_MEMORY:   return $("Error! Out of memory.");
+	default:                   return $("Failed.");
+	}
+}
+
+// Most files encrypted or decrypted by one batch of CryptFiles().
+#define AAR_CRYPT_BATCH 1024
+
+typedef struct {
+	string* paths;
+	aar_file_status* status;
+	bool decrypt;
+	aar_cipher* cipher;
+	size jobs;              // Threads for each file's blocks
+} aar_crypt_batch;
+
+/*
+  Open, encrypt or decrypt, and close one file of a batch. Only memory
+  mapped files are handled, the rest are left AAR_FILE_UNMAPPED, so
+  this runs on any thread.
+*/
+static void
+CryptFileJob(void* ctx, size job)
+{
+	aar_crypt_batch* b = ctx;
+	file* fp = OpenFile(b->paths[job], "r+");
+
+	if (!fp) {
+		b->status[job] = AAR_FILE_UNOPENED;
+		return;
+	}
+
+	// The cipher may use its context as scratch space, so every job
+	// works on its own copy.
+	aar_cipher cipher = *b->cipher;
+
+	b->status[job] = b->decrypt
+		? DecryptFile(fp, &cipher, b->jobs, NULL)
+		: EncryptFile(fp, &cipher, b->jobs, NULL);
+	CipherWipe(&cipher);
+	(void) fclose(fp);
+}
+
+/*
+  Encrypt, or decrypt if decrypt is true, the n standalone files in
+  paths with cipher. Files are handled in batches, one to each of up
+  to jobs worker threads, so that opening, growing and flushing many
+  small files overlaps. Files that can't be memory mapped are then
+  done one at a time through iobuf. Each file's outcome is printed in
+  order, then a summary. Returns the number of files that failed.
+
+  WARNING: This function uses iobuf. It's not thread safe.
+*/
+size
+CryptFiles(string* paths, size n, bool decrypt, aar_cipher* cipher, size jobs, aar_iobuf* iobuf)
+{
+	aar_file_status status[AAR_CRYPT_BATCH];
+	string verb = decrypt ? $("Decrypting") : $("Encrypting");
+	size failed = 0;
+
+	for (size first = 0; first < n; first += AAR_CRYPT_BATCH) {
+		size count = (n - first < AAR_CRYPT_BATCH) ? n - first : AAR_CRYPT_BATCH;
+		aar_crypt_batch b = {paths + first, status, decrypt, cipher, (count < jobs) ? jobs / count : 1};
+
+		ParallelFor(count, jobs, CryptFileJob, &b);
+
+		for (size i = 0; i < count; i++) {
+			string path = paths[first + i];
+
+			if (status[i] == AAR_FILE_UNOPENED) {
+				Println$("Failed to open '%s'.", path);
+				failed++;
+				continue;
+			}
+
+			Println$("%s '%s' ...", verb, path);
+			if (status[i] == AAR_FILE_UNMAPPED) {
+				file* fp = OpenFile(path, "r+");
+				status[i] = !fp ? AAR_FILE_UNOPENED
+					: decrypt ? DecryptFile(fp, cipher, jobs, iobuf)
+					: EncryptFile(fp, cipher, jobs, iobuf);
+				(void) fclose_safe(fp);
+			}
+
+			if (status[i] != AAR_FILE_OK) {
+				Println$("%s", FileStatusMessage(status[i]));
+				failed++;
+			}
+		}
+	}
+
+	Println$("%s %d of %d files.", decrypt ? $("Decrypted") : $("Encrypted"), n - failed, n);
+	return failed;
+}
+
+// Most files a multi-file add reads and encrypts at once.
+#define AAR_ADD_BATCH 256
+
+// One file of a multi-file add. Workers fill in out, the main thread
+// writes it.
+typedef struct {
+	string path;
+	string desc;
+	file* fp;
+	aar_record_header hdr;
+	u8* out;                // Encrypted record, in the IO buffer
+	size length;            // AAR_REC_BYTES(hdr)
+	aar_checksum chk;
+	bool ok;                // out holds the whole record
+} aar_ingest;
+
+typedef struct {
+	aar_archive* ar;
+	aar_ingest* files;
+	size jobs;              // Threads for each file's encryption
+} aar_ingest_batch;
+
+/*
+  Read and encrypt one file of a batch into its slice of the IO buffer
+  and close it. Files are independent, so this runs on any thread.
+*/
+static void
+IngestJob(void* ctx, size job)
+{
+	aar_ingest_batch* b = ctx;
+	aar_ingest* in = &b->files[job];
+	size hdr_length = AAR_HDR_BYTES(in->hdr);
+	size data_length = in->hdr.block_count * AAR_BLOCK_SIZE;
+	size plain = data_length - in->hdr.block_offset;
+	u8* data = in->out + hdr_length;
+
+	if (fread(data, sizeof(u8), plain, in->fp) == plain) {
+		// Every job encrypts with its own copy of the cipher.
+		aar_archive ar = *b->ar;
+		aar_cipher cipher = *b->ar->cipher;
+		ar.cipher = &cipher;
+
+		bzero(data + plain, data_length - plain);
+		(void) EncodeRecord(&ar, in->hdr, in->out);
+		in->chk = EncryptChecksum(ar.format.checksum, AAR_CHECKSUM_INIT, data, plain, &cipher, b->jobs);
+		EncodeChecksum(&ar, in->chk, data + data_length);
+		CipherWipe(&cipher);
+		in->ok = true;
+	}
+
+	(void) fclose(in->fp);
+}
+
+/*
+  Pad the record that was just written at ar->end, add it to the index
+  and move ar->end past it.
+*/
+void
+FinishRecord(aar_archive* ar, aar_record_header hdr, aar_checksum chk)
+{
+	PadRecord(ar);
+	if (ar->index.ok) {
+		IndexAppend(&ar->index, ar->end, hdr, chk);
+	}
+	ar->end = ftell(ar->fp);
+}
+
+/*
+  Append all of fin, which may be a pipe, to ar as a record described
+  by desc. The length of a header only depends on its description, so
+  the data is written after the space for it, and the header once the
+  data's length is known. Memory use is bounded by the IO buffer.
+  Returns false if the header couldn't be written. Failed writes of
+  the rest show in ferror(ar->fp).
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+bool
+IngestStream(aar_archive* ar, file* fin, string desc)
+{
+	size length;
+	aar_record_header hdr = RecordOfLength(desc, 0);
+
+	(void) fseek(ar->fp, ar->end + AAR_HDR_BYTES(hdr), SEEK_SET);
+	aar_checksum chk = IngestFile(fin, ar, &length);
+
+	hdr = RecordOfLength(desc, length);
+	bool written = WriteRecordAt(ar, hdr, ar->end);
+	(void) fseek(ar->fp, ar->end + AAR_REC_BYTES(hdr), SEEK_SET);
+	FinishRecord(ar, hdr, chk);
+	return written;
+}
+
+/*
+  Append the length bytes at data to ar as a record described by desc.
+  They're encrypted a buffer at a time, so data is left alone. Returns
+  false like IngestStream().
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+bool
+IngestBuffer(aar_archive* ar, const u8* data, size length, string desc)
+{
+	size buf_size;
+	aar_record_header hdr = RecordOfLength(desc, length);
+	aar_checksum chk = AAR_CHECKSUM_INIT;
+	u8* buf = (u8*) IoBuffer(ar->iobuf, length, &buf_size);
+
+	bool written = WriteRecordAt(ar, hdr, ar->end);
+	(void) fseek(ar->fp, ar->end + AAR_HDR_BYTES(hdr), SEEK_SET);
+
+	for (size done = 0; done < length; done += buf_size) {
+		size n = (length - done < buf_size) ? length - done : buf_size;
+		memcpy(buf, data + done, n);
+		bzero(buf + n, AAR_PADDING(n) - n);
+		chk = EncryptChecksum(ar->format.checksum, chk, buf, n, ar->cipher, ar->jobs);
+		(void) fwrite(buf, sizeof(u8), AAR_PADDING(n), ar->fp);
+	}
+
+	WriteChecksum(ar, chk);
+	FinishRecord(ar, hdr, chk);
+	return written;
+}
+
+/* Read, encrypt and append the count files of batch, in order. */
+static bool
+WriteBatch(aar_archive* ar, aar_ingest* batch, size count)
+{
+	aar_ingest_batch b = {ar, batch, (count < ar->jobs) ? ar->jobs / count : 1};
+	size used = 0;
+	size buf_size;
+	bool ok = true;
+
+	for (size i = 0; i < count; i++) {
+		used += batch[i].length;
+	}
+
+	// Short of memory, stream the files one at a time instead.
+	u8* buf = (u8*) IoBuffer(ar->iobuf, used, &buf_size);
+	if (buf_size < used) {
+		for (size i = 0; i < count; i++) {
+			Println$("Ingesting '%s' from '%s'", batch[i].desc, batch[i].path);
+			(void) IngestStream(ar, batch[i].fp, batch[i].desc);
+			(void) fclose(batch[i].fp);
+		}
+		return true;
+	}
+
+	for (size i = 0, at = 0; i < count; at += batch[i++].length) {
+		batch[i].out = buf + at;
+	}
+
+	ParallelFor(count, ar->jobs, IngestJob, &b);
+
+	for (size i = 0; i < count; i++) {
+		aar_ingest* in = &batch[i];
+
+		if (!in->ok) {
+			Println$("Failed to read '%s'.", in->path);
+			ok = false;
+			continue;
+		}
+
+		Println$("Ingesting '%s' from '%s'", in->desc, in->path);
+		(void) fseek(ar->fp, ar->end, SEEK_SET);
+		(void) fwrite(in->out, sizeof(u8), in->length, ar->fp);
+		FinishRecord(ar, in->hdr, in->chk);
+	}
+
+	return ok;
+}
+
+/*
+  Add the n files in paths to the end of ar, described by descs. Files
+  are read and encrypted in batches that fit the IO buffer, one file to
+  a thread, and then written in order by this thread. A file too big
+  for the IO buffer is streamed through it on its own. Files that can't
+  be read, or that are path, ar's own file, are skipped, and false is
+  returned.
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+bool
+AddFiles(aar_archive* ar, string path, string* paths, string* descs, size n)
+{
+	aar_ingest batch[AAR_ADD_BATCH];
+	size limit = IoBufferMax(ar->iobuf);
+	size count = 0;
+	size used = 0;
+	bool ok = true;
+
+	for (size i = 0; i < n; i++) {
+		aar_ingest in = {paths[i], descs[i]};
+
+		if (Equals(path, in.path)) {
+			Println$("Error! An archive cannot ingest itself.");
+			ok = false;
+			continue;
+		}
+
+		if (in.fp = OpenFile(in.path, "r"), !in.fp) {
+			Println$("Failed to open '%s'.", in.path);
+			ok = false;
+			continue;
+		}
+
+		in.hdr = NewRecord(in.fp, in.desc);
+		in.length = AAR_REC_BYTES(in.hdr);
+
+		if (count > 0 && (count == AAR_ADD_BATCH || used + in.length > limit)) {
+			ok = WriteBatch(ar, batch, count) && ok;
+			count = used = 0;
+		}
+
+		if (in.length > limit) {
+			Println$("Ingesting '%s' from '%s'", in.desc, in.path);
+			(void) IngestStream(ar, in.fp, in.desc);
+			(void) fclose(in.fp);
+			continue;
+		}
+
+		batch[count++] = in;
+		used += in.length;
+	}
+
+	if (count > 0) {
+		ok = WriteBatch(ar, batch, count) && ok;
+	}
+
+	return ok;
+}
+
+/*
+  Read the NUL separated paths in fp, as `find -print0` writes them,
+  into a list. The paths point into *buf. Both are the caller's to
+  free. Returns NULL if the list can't be read.
+*/
+string*
+ReadPathList(file* fp, char** buf, size* count)
+{
+	size length = 0;
+	size capacity = KiloBytes(4);
+	string* paths = NULL;
+	char* data = malloc(capacity);
+	size n;
+
+	while (data && (n = fread(data + length, 1, capacity - length - 1, fp), n > 0)) {
+		length += n;
+		if (capacity - length - 1 == 0) {
+			char* grown = realloc(data, capacity * 2);
+			if (!grown) {
+				free(data);
+				return NULL;
+			}
+			data = grown;
+			capacity *= 2;
+		}
+	}
+
+	if (!data) {
+		return NULL;
+	}
+	data[length] = '\0';
+
+	*count = 0;
+	for (size i = 0; i < length; i++) {
+		if (data[i] == '\0' || i + 1 == length) {
+			++*count;
+		}
+	}
+
+	if (paths = calloc(*count + 1, sizeof(string)), !paths) {
+		free(data);
+		return NULL;
+	}
+
+	for (size i = 0, start = 0, k = 0; i < length; i++) {
+		if (data[i] == '\0' || i + 1 == length) {
+			size end = (data[i] == '\0') ? i : i + 1;
+			paths[k++] = $$$(data + start, end - start);
+			start = i + 1;
+		}
+	}
+
+	*buf = data;
+	return paths;
+}
+
+/*
+  Write record index, whose header is hdr and whose data starts at
+  byte data, to its own encrypted file.
+*/
+void
+SplitRecord(aar_archive* ar, size index, aar_record_header hdr, size data)
+{
+	size offset = data - AAR_HDR_BYTES(hdr);
+	size length = AAR_REC_BYTES(hdr);
+	string desc = $$$(hdr.desc, hdr.desc_length);
+	aar_archive out = {OpenFile(desc, "w+"), ar->cipher, {ar->format.checksum, ar->format.align}};
+	if (!out.fp) {
+		Println$("Failed to extract record %d as '%s'", index, desc);
+		return;
+	}
+	out.iobuf = ar->iobuf;
+
+	Println$("Splitting record %d as %s", index, desc);
+
+	// Both files use the same key and checksum, so the record is
+	// copied as it is. A record of an aligned archive starts and ends
+	// on a block boundary, in the split file too, and can be cloned.
+	// In a log archive hdr may carry a newer description than the one
+	// on disk, so only the data is copied after a fresh header.
+	(void) WriteFormat(&out);
+	if (ar->format.log) {
+		WriteRecord(&out, hdr);
+		CopyFileData(ar->fp, data, out.fp, out.start + AAR_HDR_BYTES(hdr), AAR_DATA_BYTES(hdr), ar->iobuf);
+	} else if (out.format.align <= 1
+	    || !CloneFileRange(ar->fp, offset, out.fp, out.start, AlignRecord(ar, length))) {
+		CopyFileData(ar->fp, offset, out.fp, out.start, length, ar->iobuf);
+	}
+	(void) TruncateFile(out.fp, out.start + length);
+	fclose(out.fp);
+}
+
+/*
+  Decrypt the data of the record whose header is hdr, starting at byte
+  data, to out and to dst. Either may be NULL, and dst must hold all
+  of the plaintext. The data is read once, decrypted in the IO buffer
+  and only the plaintext is written out. Returns AAR_FILE_UNWRITTEN if
+  out couldn't take all of it, and the checksum's status otherwise.
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+aar_file_status
+DecryptRecord(aar_archive* ar, aar_record_header hdr, size data, file* out, u8* dst)
+{
+	size n;
+	size buf_size;
+	size left = hdr.block_count * AAR_BLOCK_SIZE;
+	size plain = left - hdr.block_offset;
+	u8* buf = (u8*) IoBuffer(ar->iobuf, left, &buf_size);
+	aar_checksum chk = AAR_CHECKSUM_INIT;
+	aar_file_status status = AAR_FILE_OK;
+	bool written = true;
+
+	while (left > 0 && (n = ReadAt(ar->fp, buf, (left < buf_size) ? left : buf_size, data), n > 0)) {
+		size len = (plain < n) ? plain : n;
+		chk = DecryptChecksum(ar->format.checksum, chk, buf, len, ar->cipher, ar->jobs);
+		if (out) {
+			written = fwrite(buf, sizeof(u8), len, out) == len && written;
+		}
+		if (dst) {
+			memcpy(dst, buf, len);
+			dst += len;
+		}
+		data += n;
+		left -= n;
+		plain -= len;
+	}
+
+	{ // Compare against the checksum block after the data
+		u8 tail[AAR_PADDING(AAR_CHECKSUM_SIZE)];
+
+		if (left > 0 || ReadAt(ar->fp, tail, sizeof(tail), data) < sizeof(tail)) {
+			status = AAR_FILE_NO_CHECKSUM;
+		} else if (DecodeChecksum(ar, tail) != chk) {
+			status = AAR_FILE_CORRUPT;
+		}
+	}
+
+	if (status != AAR_FILE_OK && !ar->quiet) {
+		Println$("%s", FileStatusMessage(status));
+	}
+	if (out && (fflush(out) != 0 || !written)) {
+		return AAR_FILE_UNWRITTEN;
+	}
+	return status;
+}
+
+/*
+  Decrypt length bytes of a record's data, starting offset bytes in,
+  to out. The range is cut off at the end of the data. hdr is the
+  record's header, and its data starts at byte data. Blocks are
+  encrypted on their own, so only the ones holding the range are
+  read. The checksum covers all of the data and isn't
+  checked. Returns false if the range can't be read or written.
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+bool
+DecryptRecordRange(aar_archive* ar, aar_record_header hdr, size data, size offset, size length, file* out)
+{
+	size plain = hdr.block_count * AAR_BLOCK_SIZE - hdr.block_offset;
+	size buf_size;
+
+	if (offset >= plain) {
+		return true;
+	}
+	if (length > plain - offset) {
+		length = plain - offset;
+	}
+
+	size first = offset - offset % AAR_BLOCK_SIZE;
+	size skip = offset - first;
+	size left = AAR_PADDING(offset + length) - first;
+	u8* buf = (u8*) IoBuffer(ar->iobuf, left, &buf_size);
+
+	data += first;
+	while (left > 0) {
+		size n = (left < buf_size) ? left : buf_size;
+		if (ReadAt(ar->fp, buf, n, data) < n) {
+			return false;
+		}
+		DecryptBlocksParallel(buf, AAR_BLOCKS(n), ar->cipher, ar->jobs);
+
+		size len = (n - skip < length) ? n - skip : length;
+		if (fwrite(buf + skip, sizeof(u8), len, out) < len) {
+			return false;
+		}
+		length -= len;
+		left -= n;
+		data += n;
+		skip = 0;
+	}
+
+	return fflush(out) == 0;
+}
+
+/*
+  Decrypt a record to out and close it. A failed write is printed the
+  way DecryptRecord() prints a bad checksum. Returns false on either.
+*/
+static bool
+RestoreRecord(aar_archive* ar, aar_record_header hdr, size data, file* out)
+{
+	aar_file_status status = DecryptRecord(ar, hdr, data, out, NULL);
+
+	if (fclose(out) != 0) {
+		status = AAR_FILE_UNWRITTEN;
+	}
+	if (status == AAR_FILE_UNWRITTEN) {
+		Println$("%s", FileStatusMessage(status));
+	}
+	return status == AAR_FILE_OK;
+}
+
+/*
+  Decrypt record index, whose header is hdr and whose data starts at
+  byte data, to a file named after its description. Returns false if
+  the file can't be opened or written or the data is corrupted.
+*/
+bool
+ExtractRecord(aar_archive* ar, size index, aar_record_header hdr, size data)
+{
+	string desc = $$$(hdr.desc, hdr.desc_length);
+	file* out = OpenFile(desc, "w");
+	if (!out) {
+		Println$("Failed to extract record %d as '%s'", index, desc);
+		return false;
+	}
+
+	Println$("Extracting record %d as %s", index, desc);
+	return RestoreRecord(ar, hdr, data, out);
+}
+
+// Most records extracted by one batch of extract-all.
+#define AAR_EXTRACT_BATCH 256
+
+typedef struct {
+	size index;
+	aar_record_header hdr;
+	size data;              // Offset of the record's data
+	file* out;              // NULL if it couldn't be opened
+	u8* buf;                // Data and checksum, in the IO buffer
+	aar_file_status status; // Of the checksum
+	bool written;           // All of the data reached the file
+} aar_restore;
+
+typedef struct {
+	aar_archive* ar;
+	aar_restore* records;
+	size jobs;              // Threads for each record's decryption
+} aar_restore_batch;
+
+/*
+  Read, decrypt and check one record of a batch in its slice of the IO
+  buffer, write it out and close its file. Records whose file couldn't
+  be opened are skipped. Records are independent, so this runs on any
+  thread.
+*/
+static void
+RestoreJob(void* ctx, size job)
+{
+	aar_restore_batch* b = ctx;
+	aar_restore* r = &b->records[job];
+
+	if (!r->out) {
+		return;
+	}
+
+	size data_length = r->hdr.block_count * AAR_BLOCK_SIZE;
+	size plain = data_length - r->hdr.block_offset;
+	size length = AAR_DATA_BYTES(r->hdr);
+
+	r->status = AAR_FILE_NO_CHECKSUM;
+	r->written = true;
+	if (ReadAt(b->ar->fp, r->buf, length, r->data) == length) {
+		// Every job decrypts with its own copy of the cipher.
+		aar_archive ar = *b->ar;
+		aar_cipher cipher = *b->ar->cipher;
+		ar.cipher = &cipher;
+
+		aar_checksum chk = DecryptChecksum(ar.format.checksum, AAR_CHECKSUM_INIT, r->buf, plain, &cipher, b->jobs);
+		r->status = (DecodeChecksum(&ar, r->buf + data_length) == chk) ? AAR_FILE_OK : AAR_FILE_CORRUPT;
+		CipherWipe(&cipher);
+		r->written = fwrite(r->buf, sizeof(u8), plain, r->out) == plain;
+	}
+
+	if (fclose(r->out) != 0) {
+		r->written = false;
+	}
+}
+
+/*
+  Extract the count records of batch on the worker threads. Returns
+  false if any failed.
+*/
+static bool
+ExtractBatch(aar_archive* ar, aar_restore* batch, size count)
+{
+	aar_restore_batch b = {ar, batch, (count < ar->jobs) ? ar->jobs / count : 1};
+	size used = 0;
+	size buf_size;
+	bool ok = true;
+
+	for (size i = 0; i < count; i++) {
+		if (batch[i].out) {
+			used += AAR_DATA_BYTES(batch[i].hdr);
+		}
+	}
+
+	// Short of memory, extract the records one at a time instead.
+	u8* buf = (u8*) IoBuffer(ar->iobuf, used, &buf_size);
+	bool serial = buf_size < used;
+
+	for (size i = 0, at = 0; i < count && !serial; i++) {
+		if (batch[i].out) {
+			batch[i].buf = buf + at;
+			at += AAR_DATA_BYTES(batch[i].hdr);
+		}
+	}
+
+	if (!serial) {
+		ParallelFor(count, ar->jobs, RestoreJob, &b);
+	}
+
+	for (size i = 0; i < count; i++) {
+		aar_restore* r = &batch[i];
+		string desc = $$$(r->hdr.desc, r->hdr.desc_length);
+
+		if (!r->out) {
+			Println$("Failed to extract record %d as '%s'", r->index, desc);
+			ok = false;
+			continue;
+		}
+
+		Println$("Extracting record %d as %s", r->index, desc);
+		if (serial) {
+			ok = RestoreRecord(ar, r->hdr, r->data, r->out) && ok;
+			continue;
+		}
+
+		if (r->status != AAR_FILE_OK) {
+			Println$("%s", FileStatusMessage(r->status));
+		}
+		if (!r->written) {
+			Println$("%s", FileStatusMessage(AAR_FILE_UNWRITTEN));
+		}
+		ok = ok && r->status == AAR_FILE_OK && r->written;
+	}
+
+	return ok;
+}
+
+/*
+  Extract every record of ar to files named after them. Records are
+  located in one walk and extracted in batches that fit the IO buffer,
+  one record to a thread: each is read with its own pread, decrypted,
+  checked and written out. Messages come out in record order. A record
+  too big for the IO buffer is streamed through it on its own. A batch
+  ends early at a name it already holds, so a later record of the same
+  name still replaces the earlier one. Returns false if any record
+  can't be extracted or is corrupted, or if a corrupted header hides
+  the records after it.
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+bool
+ArchiveExtractAll(aar_archive* ar)
+{
+	aar_restore batch[AAR_EXTRACT_BATCH];
+	aar_record_iter it = IterRecords(ar);
+	size limit = IoBufferMax(ar->iobuf);
+	size count = 0;
+	size used = 0;
+	bool ok = true;
+
+	while (NextRecord(&it)) {
+		aar_restore r = {it.index, it.hdr, it.data};
+		string desc = $$$(r.hdr.desc, r.hdr.desc_length);
+		size length = AAR_DATA_BYTES(r.hdr);
+		bool repeat = false;
+
+		for (size i = 0; i < count && !repeat; i++) {
+			repeat = Equals(desc, $$$(batch[i].hdr.desc, batch[i].hdr.desc_length));
+		}
+
+		if (count > 0 && (repeat || count == AAR_EXTRACT_BATCH || used + length > limit)) {
+			ok = ExtractBatch(ar, batch, count) && ok;
+			count = used = 0;
+		}
+
+		if (length > limit) {
+			ok = ExtractRecord(ar, r.index, r.hdr, r.data) && ok;
+			continue;
+		}
+
+		// A file that can't be opened is reported in its turn.
+		if (r.out = OpenFile(desc, "w"), r.out) {
+			used += length;
+		}
+		batch[count++] = r;
+	}
+
+	if (count > 0) {
+		ok = ExtractBatch(ar, batch, count) && ok;
+	}
+
+	return WalkedAll(&it) && ok;
+}
+
+/*
+  Find record index like FindRecord(), and print a warning if it
+  doesn't exist.
+*/
+bool
+LocateRecord(aar_archive* ar, size index, aar_record_header* hdr, size* data)
+{
+	size offset;
+
+	if (!FindRecord(ar, index, hdr, &offset, data)) {
+		Println$("Warning: Record %d doesn't exist.", index);
+		return false;
+	}
+	return true;
+}
+
+/*
+  Decrypt record index to out, or to a file named after it when out is
+  NULL. Returns false if it doesn't exist or its data is corrupted.
+*/
+bool
+ArchiveExtract(aar_archive* ar, size index, file* out)
+{
+	aar_record_header hdr;
+	size data;
+
+	if (!LocateRecord(ar, index, &hdr, &data)) {
+		return false;
+	}
+
+	if (out) {
+		return DecryptRecord(ar, hdr, data, out, NULL) == AAR_FILE_OK;
+	}
+
+	return ExtractRecord(ar, index, hdr, data);
+}
+
+/*
+  Decrypt length bytes of record index, starting offset bytes into its
+  data, to out. See DecryptRecordRange().
+*/
+bool
+ArchiveReadRange(aar_archive* ar, size index, size offset, size length, file* out)
+{
+	aar_record_header hdr;
+	size data;
+
+	return LocateRecord(ar, index, &hdr, &data) && DecryptRecordRange(ar, hdr, data, offset, length, out);
+}
+
+static int
+CompareSize(const void* a, const void* b)
+{
+	size x = *(const size*) a;
+	size y = *(const size*) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+  Delete the records numbered in targets, n of them, in any order and
+  with repeats, and store how many were deleted in *deleted. The
+  numbers are the ones from before the delete. The records are found
+  in one walk, and the records that survive after the first deleted
+  one are moved back once, so deleting any number of records costs one
+  pass over the archive. A log archive gets a delete log record for
+  each instead. Returns AAR_FILE_NO_MEMORY or AAR_FILE_CORRUPT, with
+  nothing deleted, if memory runs out or a corrupted header comes
+  before one of the targets, and AAR_FILE_UNWRITTEN if the archive
+  couldn't all be rewritten.
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+aar_file_status
+DeleteRecords(aar_archive* ar, size* targets, size n, size* deleted)
+{
+	size found = 0;
+	size removed = 0;
+	bool written = true;
+	aar_file_status status = AAR_FILE_OK;
+	size* starts = calloc(n, sizeof(size));
+	size* lengths = calloc(n, sizeof(size));
+	aar_record_iter it = IterRecords(ar);
+
+	if (!starts || !lengths) {
+		status = AAR_FILE_NO_MEMORY;
+		goto done;
+	}
+
+	qsort(targets, n, sizeof(size), CompareSize);
+	for (size i = 0; i < n; i++) {
+		bool more = true;
+
+		if (i > 0 && targets[i] == targets[i - 1]) {
+			continue;
+		}
+		if (ar->index.ok) {
+			it.count = (targets[i] < ar->index.count) ? targets[i] : ar->index.count;
+		}
+		while ((more = NextRecord(&it)) && it.index < targets[i]) {
+		}
+		if (!more && !WalkedAll(&it)) {
+			found = 0;
+			status = AAR_FILE_CORRUPT;
+			goto done;
+		}
+		if (!more) {
+			if (!ar->quiet) {
+				Println$("Record index '%d' does not exist.", targets[i]);
+			}
+			continue;
+		}
+
+		if (!ar->quiet) {
+			Println$("Deleting %d %s", it.index, $$$(it.hdr.desc, it.hdr.desc_length));
+		}
+		targets[found] = it.index;
+		starts[found] = it.offset;
+		lengths[found++] = it.next - it.offset;
+	}
+
+	if (ar->format.log) {
+		aar_record_header tombstone = {0};
+		for (size i = 0; i < found; i++) {
+			AppendLogRecord(ar, AAR_RECORD_DELETE, starts[i], tombstone);
+			lengths[i] = 0;
+		}
+		written = fflush(ar->fp) == 0 && !ferror(ar->fp);
+	} else {
+		size fsize = FileSize(ar->fp);
+
+		// Every run of surviving records between two deleted ones
+		// moves back by all that was deleted before it.
+		for (size i = 0; i < found; i++) {
+			size x0 = starts[i] + lengths[i];
+			size x1 = (i + 1 < found) ? starts[i + 1] : fsize;
+
+			removed += lengths[i];
+			if (x1 > x0) {
+				written = ShiftFileData(ar->fp, ar->iobuf, -(i64) removed, x0, x1) && written;
+			}
+		}
+		if (found > 0 && FileSize(ar->fp) > fsize - removed) {
+			written = TruncateFile(ar->fp, fsize - removed) && written;
+		}
+		ar->end -= removed;
+	}
+
+	if (ar->index.ok && found > 0) {
+		IndexRemoveRecords(&ar->index, targets, lengths, found);
+	}
+	if (!written) {
+		status = AAR_FILE_UNWRITTEN;
+	}
+
+done:
+	// A corrupted header was already printed.
+	if (status != AAR_FILE_OK && status != AAR_FILE_CORRUPT && !ar->quiet) {
+		Println$("%s", FileStatusMessage(status));
+	}
+	free(starts);
+	free(lengths);
+	*deleted = found;
+	return status;
+}
+
+/*
+  Rewrite the live records of ar, the archive at path, into a new
+  archive with key next to it and rename that over path. Deleted
+  records, log records and stale index data are left behind. Nothing
+  is changed until the rename, which replaces the archive atomically,
+  and there's no rename if a record's header is corrupted.
+
+  WARNING: This function uses the archive's IO buffer. It's not thread
+  safe.
+*/
+bool
+ArchiveCompact(aar_archive* ar, string path, aes_key key)
+{
+	char tmp[path.length + sizeof(".compact")];
+	char dst[path.length + 1];
+	u8 tail[AAR_PADDING(AAR_CHECKSUM_SIZE)];
+
+	bzero(dst, sizeof(dst));
+	memcpy(dst, path.s, path.length);
+	memcpy(tmp, path.s, path.length);
+	memcpy(tmp + path.length, ".compact", sizeof(".compact"));
+	(void) remove(tmp); // Left over from an interrupted compact
+
+	aar_format format = {ar->format.checksum, ar->format.align, 0, 0, ar->format.log};
+	aar_archive out = {ArchiveCreate($$(tmp), key, ar->cipher, format), ar->cipher, format};
+	if (!out.fp) {
+		return false;
+	}
+	out.start = ftell(out.fp);
+	out.iobuf = ar->iobuf;
+	out.jobs = ar->jobs;
+
+	aar_record_iter it = IterRecords(ar);
+	while (NextRecord(&it)) {
+		size offset = ftell(out.fp);
+
+		WriteRecord(&out, it.hdr);
+		CopyFileData(ar->fp, it.data, out.fp, ftell(out.fp), AAR_DATA_BYTES(it.hdr), ar->iobuf);
+		PadRecord(&out);
+
+		(void) IterRead(&it, it.data + it.hdr.block_count * AAR_BLOCK_SIZE, tail, sizeof(tail));
+		IndexAppend(&out.index, offset, it.hdr, DecodeChecksum(ar, tail));
+	}
+
+	out.end = ftell(out.fp);
+	out.index.ok = HasFormatBlock(&out);
+
+	// Records past a corrupted header would be lost in the rename.
+	bool ok = WalkedAll(&it)
+		&& (!ar->index.ok || it.count == ar->index.count)
+		&& (!out.index.ok || WriteIndex(&out))
+		&& CopyFileMode(ar->fp, out.fp)
+		&& SyncFile(out.fp);
+
+	IndexFree(&out.index);
+	(void) fclose(out.fp);
+
+	if (!ok || rename(tmp, dst) != 0) {
+		(void) remove(tmp);
+		return false;
+	}
+
+	Println$("Compacted %d records.", it.count);
+	return true;
+}
+
+#ifndef AAR_NO_MAIN
+/* Wipe key material from memory. Registered with atexit(3). */
+static void
+WipeMemory(void)
+{
+	CipherWipe(&mem.cipher);
+	IoBufferWipe(&mem.iobuf);
+	bzero(&mem.key, sizeof(mem.key));
+}
+
+void
+Usage(string cmd)
+{
+	Println$("Usage:  %s [OPTIONS] COMMAND\n\n"
+
+		 "Options:\n"
+		 "  -k  --key=KEY       AES key encoded with base64.\n"
+		 "  -a  --archive=FILE  AAR archive filename.\n"
+		 "  -j  --jobs=N        Threads used for encryption and extract-all.\n"
+		 "                      (Default: CPU count)\n"
+		 "      --checksum=KIND Checksum for new archives, crc32c or bsd. (Default: crc32c)\n"
+		 "      --io-buffer=N   Largest IO buffer in bytes, or with a K, M or G suffix. (Default: 100M)\n"
+		 "      --align=N       Pad records of new archives to N bytes, e.g. 4K. (Default: packed)\n"
+		 "      --log           Make new archives append deletes and renames until compacted.\n\n"
+
+		 "Commands:\n"
+		 "  new          Generate a random AES-256 bit key.\n"
+		 "  list         List all file names.\n"
+		 "  add          Add a file to an archive: FILE [DESCRIPTION]\n"
+		 "               Use - DESCRIPTION to add the data from stdin.\n"
+		 "               Add many files with --files FILE... or, with no FILE,\n"
+		 "               a NUL separated list of them from stdin.\n"
+		 "  delete       Delete a record.\n"
+		 "  extract      Extract a single record. With --stdout, write it to stdout.\n"
+		 "  cat          Write records to stdout, same as extract --stdout.\n"
+		 "               --offset=N and --length=N write only that part of them.\n"
+		 "  extract-all  Extract all records.\n"
+		 "  split        Divide the archive's records into individually encrypted files.\n"
+		 "  rename       Change the description.\n"
+		 "  compact      Rewrite the archive without deleted records.\n"
 		 "  encrypt      Encrypt a file without adding it to an archive.\n"
 		 "  decrypt      Decrypt a file that's independent from an archive.", cmd);
 }
@@ -527,6 +2660,12 @@ Main(int argc, string* argv)
 {
 	aes_key_ok given_key = {0};
 
+	(void) atexit(WipeMemory);
+	mem.jobs = CpuCount();
+	IoBufferLimit(&mem.iobuf, AAR_IOBUF);
+	mem.checksum = AAR_CHECKSUM_CRC32C;
+	ChecksumSetup();
+
 	if (argc <= 1) {
 		Usage(argv[0]);
 		exit(-1);
@@ -570,6 +2709,46 @@ Main(int argc, string* argv)
 				Println$("No archive filename given.");
 				exit(-1);
 			}
+		} else if (Equals$("-j", *argv)) {
+			shift(argc, argv);
+			if (argc < 1 || Atoi(*argv) < 1) {
+				Println$("Invalid number of jobs.");
+				exit(-1);
+			}
+			mem.jobs = Atoi(*argv);
+		} else if (HasPrefix$("--jobs=", *argv)) {
+			string n = Slice(*argv, $("--jobs=").length, argv[0].length);
+			if (Atoi(n) < 1) {
+				Println$("Invalid number of jobs.");
+				exit(-1);
+			}
+			mem.jobs = Atoi(n);
+		} else if (HasPrefix$("--checksum=", *argv)) {
+			string kind = Slice(*argv, $("--checksum=").length, argv[0].length);
+			aar_checksum_kind_ok _kind = ChecksumKind(kind);
+			if (!_kind.ok) {
+				Println$("Unknown checksum '%s'.", kind);
+				exit(-1);
+			}
+			mem.checksum = _kind.value;
+		} else if (HasPrefix$("--io-buffer=", *argv)) {
+			size_ok limit = ParseBytes(Slice(*argv, $("--io-buffer=").length, argv[0].length));
+			if (!limit.ok || limit.value == 0) {
+				Println$("Invalid IO buffer size.");
+				exit(-1);
+			}
+			IoBufferLimit(&mem.iobuf, limit.value);
+		} else if (HasPrefix$("--align=", *argv)) {
+			size_ok align = ParseBytes(Slice(*argv, $("--align=").length, argv[0].length));
+			if (!align.ok || align.value < AAR_BLOCK_SIZE
+			    || align.value > ((size) 1 << AAR_ALIGN_MAX_SHIFT)
+			    || (align.value & (align.value - 1)) != 0) {
+				Println$("The alignment must be a power of two from 16 bytes to 1G.");
+				exit(-1);
+			}
+			mem.align = align.value;
+		} else if (Equals$("--log", *argv)) {
+			mem.log = true;
 		} else {
 			Println$("Unknown flag '%s'.", *argv);
 			exit(-1);
@@ -596,7 +2775,9 @@ Main(int argc, string* argv)
 
 		// Create an archive if one was provided.
 		if (mem.stable.archive.length > 0) {
-			file* fp = ArchiveCreate(mem.stable.archive, mem.key.raw);
+			CipherInit(&mem.cipher, mem.key.raw);
+			aar_format format = {mem.checksum, mem.align, 0, 0, mem.log};
+			file* fp = ArchiveCreate(mem.stable.archive, mem.key.raw, &mem.cipher, format);
 			if (!fp) {
 				exit(-1);
 			}
@@ -614,6 +2795,8 @@ Main(int argc, string* argv)
 		exit(-1);
 	}
 
+	CipherInit(&mem.cipher, mem.key.raw);
+
 	if (Equals$("encrypt", *argv)) {
 		shift(argc, argv);
 
@@ -622,18 +2805,7 @@ Main(int argc, string* argv)
 			exit(0);
 		}
 
-		for (size i = 0; i < argc; i++) {
-			file* fp = fopen(argv[i].s, "r+");
-			if (!fp) {
-				Println$("Failed to open '%s'.", argv[i]);
-			} else {
-				Println$("Encrypting '%s' ...", argv[i]);
-				EncryptFile(fp, mem.key.raw);
-				fclose(fp);
-			}
-		}
-		
-		exit(0);
+		exit(CryptFiles(argv, argc, false, &mem.cipher, mem.jobs, &mem.iobuf) > 0 ? -1 : 0);
 	} else if (Equals$("decrypt", *argv)) {
 		shift(argc, argv);
 
@@ -642,34 +2814,29 @@ Main(int argc, string* argv)
 			exit(0);
 		}
 
-		for (size i = 0; i < argc; i++) {
-			file* fp = fopen(argv[i].s, "r+");
-			if (!fp) {
-				Println$("Failed to open '%s'.", argv[i]);
-			} else {
-				Println$("Decrypting '%s' ...", argv[i]);
-				DecryptFile(fp, mem.key.raw);
-				fclose(fp);
-			}
-		}
-		
-		exit(0);
+		exit(CryptFiles(argv, argc, true, &mem.cipher, mem.jobs, &mem.iobuf) > 0 ? -1 : 0);
 	}
 
 	// The rest of the commands require an opened archive.
 
-	file* archive_file = ArchiveOpen(mem.stable.archive);
-	if (!archive_file) {
-		Println$("Failed to open archive file.");
-		goto error;
+	// cat writes records to stdout, so messages go to stderr instead.
+	// So does extract with --stdout anywhere in its arguments.
+	file* out = NULL;
+	bool to_stdout = Equals$("cat", *argv);
+	for (size i = 1; i < argc && Equals$("extract", *argv); i++) {
+		to_stdout = to_stdout || Equals$("--stdout", argv[i]);
 	}
-
-	if (!archive_file) {
-		goto error;
+	if (to_stdout) {
+		if (out = TakeStdout(), !out) {
+			Println$("Failed to open stdout.");
+			exit(-1);
+		}
 	}
 
-	if (given_key = ArchiveValidate(archive_file, mem.key.raw), !given_key.ok) {
-		Println$("Key doesn't match archive's key.");
+	aar_archive archive = {NULL, &mem.cipher};
+	archive.iobuf = &mem.iobuf;
+	archive.jobs = mem.jobs;
+	if (OpenArchive(&archive, mem.stable.archive, mem.key.raw) != AAR_FILE_OK) {
 		goto error;
 	}
 
@@ -677,84 +2844,139 @@ Main(int argc, string* argv)
 	if (Equals$("add", *argv)) {
 		shift(argc, argv);
 
-		string filepath, desc;
-
-		if (Equals(mem.stable.archive, argv[0])) {
-			Println$("Error! An archive cannot ingest itself.");
-			goto error;
-		}
+		string* paths = argv;
+		string* descs = argv;
+		size count = 1;
+		char* list = NULL;
 
 		if (argc < 1) {
 			Println$("Error! Please supply a file to ingest and a description.");
 			goto error;
-		} else {
-			filepath = argv[0];
 		}
 
-		if (argc >= 2) {
-			desc  = argv[1];
-		} else {
-			desc = argv[0];
-		}
+		PrepareIndex(&archive);
+		if (Equals$("--files", *argv)) {
+			shift(argc, argv);
+			paths = descs = argv;
+			count = argc;
+			if (argc == 0 && (paths = descs = ReadPathList(stdin, &list, &count), !paths)) {
+				Println$("Error! Failed to read the file list.");
+				goto error;
+			}
+		} else if (Equals$("-", *argv)) {
+			if (argc < 2) {
+				Println$("Error! Please supply a description for the data from stdin.");
+				goto error;
+			}
 
-		fseek(archive_file, 0, SEEK_END);
+			Println$("Ingesting '%s' from stdin", argv[1]);
+			(void) IngestStream(&archive, stdin, argv[1]);
+			count = 0;
+		} else if (argc >= 2) {
+			descs = argv + 1;
+		}
 
-		// WARNING: filepath.s is safe because it came from main's argv
-		file* ingest_file = fopen(filepath.s, "r");
-		if (!ingest_file) {
-			Println$("Failed to open '%s'.", filepath);
+		bool added = AddFiles(&archive, mem.stable.archive, paths, descs, count);
+		if (list) {
+			free(paths);
+			free(list);
+		}
+		if (!added) {
 			goto error;
 		}
-
-		Println$("Ingesting '%s' from '%s'", desc, filepath);
-		aar_record_header hdr = NewRecord(ingest_file, desc);
-		
-		WriteRecord(archive_file, hdr, mem.key.raw);
-		IngestFile(ingest_file, archive_file, mem.key.raw);
-
-		(void) fclose(ingest_file);
 	} else if (Equals$("delete", *argv)) {
 		shift(argc, argv);
 
-		for (size i = 0; i < argc; i++) {
-			size index = Atoi(argv[i]) - i;
-
-			if (SeekRecord(archive_file, index, mem.key.raw)) {
-				aar_record_header_ok _hdr = ReadRecord(archive_file, mem.key.raw);
-				if (!_hdr.ok) {
-					Println$("Error! Record index '%s' is corrupt. Aborting...", argv[i]);
-					goto error;
-				}
+		if (argc < 1) {
+			Println$("Supply the numbers of the records to delete.");
+			goto error;
+		}
 
-				aar_record_header hdr = _hdr.value;
-				size record_length = AAR_HDR_BYTES(hdr) + AAR_DATA_BYTES(hdr);
-				size x0 = ftell(archive_file) + AAR_DATA_BYTES(hdr);
-				size x1 = FileSize(archive_file);
+		size* targets = calloc(argc, sizeof(size));
+		if (!targets) {
+			Println$("Error! Out of memory.");
+			goto error;
+		}
+		for (size i = 0; i < argc; i++) {
+			size_ok n = ParseIndex(argv[i]);
+			if (!n.ok) {
+				Println$("Invalid record number '%s'.", argv[i]);
+				free(targets);
+				goto error;
+			}
+			targets[i] = n.value;
+		}
 
-				Println$("Deleting %d %s", i, $$$(hdr.desc, hdr.desc_length));
+		size deleted;
+		PrepareIndex(&archive);
+		aar_file_status status = DeleteRecords(&archive, targets, argc, &deleted);
+		free(targets);
+		if (status != AAR_FILE_OK) {
+			goto error;
+		}
+	} else if (Equals$("list", *argv)) {
+		if (archive.index.ok) {
+			for (size i = 0; i < archive.index.count; i++) {
+				aar_index_entry* e = &archive.index.entries[i];
+				Println$("%d    %s", i, $$$(archive.index.descs + e->desc, e->desc_length));
+			}
+		} else {
+			aar_record_iter it = IterRecords(&archive);
+			while (NextRecord(&it)) {
+				Println$("%d    %s", it.index, $$$(it.hdr.desc, it.hdr.desc_length));
+			}
+			if (!WalkedAll(&it)) {
+				goto error;
+			}
+		}
+	} else if (Equals$("extract", *argv) || Equals$("cat", *argv)) {
+		shift(argc, argv);
 
-				if (x0 == x1) {
-					TruncateFile(archive_file, x1 - record_length);
-				} else {
-					ShiftFileData(archive_file, -record_length, x0, x1);
-				}
+		// A byte range of each record's data, with --offset and --length.
+		size offset = 0;
+		size length = ~(size) 0;
+		size records = 0;
+		bool ranged = false;
+		for (size i = 0; i < argc; i++) {
+			size_ok n = {0};
+			if (Equals$("--stdout", argv[i])) {
+				continue;
+			} else if (HasPrefix$("--offset=", argv[i])) {
+				n = ParseBytes(Slice(argv[i], $("--offset=").length, argv[i].length));
+				offset = n.value;
+			} else if (HasPrefix$("--length=", argv[i])) {
+				n = ParseBytes(Slice(argv[i], $("--length=").length, argv[i].length));
+				length = n.value;
+			} else if (ParseIndex(argv[i]).ok) {
+				argv[records++] = argv[i];
+				continue;
 			} else {
-				Println$("Record index '%s' does not exist.", argv[i]);
+				Println$("Invalid record number '%s'.", argv[i]);
+				goto error;
 			}
+			if (!n.ok) {
+				Println$("Invalid range '%s'.", argv[i]);
+				goto error;
+			}
+			ranged = true;
 		}
-	} else if (Equals$("list", *argv)) {
-		fseek(archive_file, AAR_KEY_SIZE, SEEK_SET);
 
-		aar_record_header_ok hdr;
-		for (size i = 0; hdr = ReadRecord(archive_file, mem.key.raw), hdr.ok; i++) {
-			Println$("%d    %s", i, $$$(hdr.value.desc, hdr.value.desc_length));
-			fseek(archive_file, AAR_DATA_BYTES(hdr.value), SEEK_CUR);
+		if (ranged && !out) {
+			Println$("A range can only be written to stdout.");
+			goto error;
 		}
-	} else if (Equals$("extract", *argv)) {
-		shift(argc, argv);
-		for (size i = 0; i < argc; i++) {
-			size index = Atoi(argv[i]);
-			ArchiveExtract(archive_file, index, mem.key.raw);
+
+		bool ok = true;
+		for (size i = 0; i < records; i++) {
+			size index = ParseIndex(argv[i]).value;
+			if (ranged) {
+				ok = ArchiveReadRange(&archive, index, offset, length, out) && ok;
+			} else {
+				ok = ArchiveExtract(&archive, index, out) && ok;
+			}
+		}
+		if (out && (fclose(out) != 0 || !ok)) {
+			goto error;
 		}
 	} else if (Equals$("rename", *argv)) {
 		shift(argc, argv);
@@ -766,50 +2988,91 @@ Main(int argc, string* argv)
 
 		// TODO: Check if *argv is a number
 		size index = Atoi(*argv);
-		if (!SeekRecord(archive_file, index, mem.key.raw)) {
-			Println$("Record '%s' doesn't exist.", *argv);
-			goto error;
-		}
+		PrepareIndex(&archive);
 
-		size pos = ftell(archive_file);
-		aar_record_header_ok _hdr = ReadRecord(archive_file, mem.key.raw);
-		if (!_hdr.ok) {
-			Println$("Record '%d' is corrupted.", index);
+		// In a log archive, hdr has the latest description, not the
+		// one on disk. Only the log branch uses it then.
+		aar_record_header hdr;
+		size pos, data;
+		if (!FindRecord(&archive, index, &hdr, &pos, &data)) {
+			Println$("Record '%s' doesn't exist.", *argv);
 			goto error;
 		}
 
-		aar_record_header hdr = _hdr.value;
 		aar_record_header new_hdr = hdr;
+		if (argv[1].length > AAR_DESC_MAX) {
+			argv[1].length = AAR_DESC_MAX;
+		}
 		memcpy(new_hdr.desc, argv[1].s, argv[1].length);
 		new_hdr.desc_length = argv[1].length;
 
 		Println$("%d: %s -> %s", index, $$$(hdr.desc, hdr.desc_length), argv[1]);
 
-		ShiftFileData(
-			archive_file,
-			AAR_HDR_BYTES(new_hdr) - AAR_HDR_BYTES(hdr),
-			pos + AAR_HDR_BYTES(hdr),
-			FileSize(archive_file));
+		if (archive.format.log) {
+			AppendLogRecord(&archive, AAR_RECORD_RENAME, pos, new_hdr);
+			IndexRename(&archive.index, index, new_hdr, 0);
+		} else {
+			int delta = AAR_HDR_BYTES(new_hdr) - AAR_HDR_BYTES(hdr);
+			i64 moved = delta;
+			size data = pos + AAR_HDR_BYTES(hdr);
+			size fsize = FileSize(archive.fp);
+
+			if (archive.format.align <= 1) {
+				(void) ShiftFileData(archive.fp, archive.iobuf, delta, data, fsize);
+			} else if (delta != 0) {
+				// Only the renamed record's data moves by delta. The
+				// records after it move by whole alignment units.
+				size data_end = data + AAR_DATA_BYTES(hdr);
+				size old_end = AlignRecord(&archive, data_end);
+				size new_end = AlignRecord(&archive, data_end + delta);
+
+				if (new_end > old_end && old_end < fsize) {
+					(void) ShiftFileData(archive.fp, archive.iobuf, new_end - old_end, old_end, fsize);
+				}
+				(void) ShiftFileData(archive.fp, archive.iobuf, delta, data, data_end);
+				if (new_end < old_end && old_end < fsize) {
+					(void) ShiftFileData(archive.fp, archive.iobuf, new_end - old_end, old_end, fsize);
+				}
+				if (old_end >= fsize) {
+					(void) TruncateFile(archive.fp, new_end);
+				}
+				moved = new_end - old_end;
+			}
+
+			(void) WriteRecordAt(&archive, new_hdr, pos);
 
-		(void) fseek(archive_file, pos, SEEK_SET);
-		WriteRecord(archive_file, new_hdr, mem.key.raw);
+			archive.end += moved;
+			if (archive.index.ok) {
+				IndexRename(&archive.index, index, new_hdr, moved);
+			}
+		}
 	} else if (Equals$("extract-all", *argv)) {
-		for (size i = 0; SeekRecord(archive_file, i, mem.key.raw); i++) {
-			ArchiveExtract(archive_file, i, mem.key.raw);
+		if (!ArchiveExtractAll(&archive)) {
+			goto error;
 		}
 	} else if (Equals$("split", *argv)) {
-		for (size i = 0; SeekRecord(archive_file, i, mem.key.raw); i++) {
-			ArchiveSplit(archive_file, i, mem.key.raw);
+		aar_record_iter it = IterRecords(&archive);
+		while (NextRecord(&it)) {
+			SplitRecord(&archive, it.index, it.hdr, it.data);
+		}
+		if (!WalkedAll(&it)) {
+			goto error;
+		}
+	} else if (Equals$("compact", *argv)) {
+		if (!ArchiveCompact(&archive, mem.stable.archive, mem.key.raw)) {
+			Println$("Failed to compact the archive.");
+			goto error;
 		}
 	} else {
 		Println$("Unknown command: '%s'", *argv);
 		goto error;
 	}
 
-	(void) fclose_safe(archive_file);
+	(void) CloseArchive(&archive);
 	exit(0);
 	
 error:
-	(void) fclose_safe(archive_file);
+	(void) CloseArchive(&archive);
 	exit(-1);
 }
+#endif
@@ -23,6 +23,240 @@ TruncateFile(file* fp, size offset)
 	return result;
 }
 
+/*
+  Read up to len bytes at offset in fp's file into buf with pread(2).
+  fp's position isn't used or moved, so threads can read the same
+  file at once. fp is flushed first, so stdio buffers can't get out
+  of step with the file. Returns the number of bytes read, which is
+  only short at the end of the file or on an error.
+*/
+size
+ReadAt(file* fp, void* buf, size len, size offset)
+{
+	size done = 0;
+
+	(void) fflush(fp);
+	while (done < len) {
+		ssize_t n = pread(fileno(fp), (u8*) buf + done, len - done, offset + done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+/*
+  Write len bytes of buf at offset in fp's file with pwrite(2), the
+  same way ReadAt() reads. Returns the number of bytes written.
+*/
+size
+WriteAt(file* fp, const void* buf, size len, size offset)
+{
+	size done = 0;
+
+	(void) fflush(fp);
+	while (done < len) {
+		ssize_t n = pwrite(fileno(fp), (const u8*) buf + done, len - done, offset + done);
+		if (n <= 0) {
+			break;
+		}
+		done += n;
+	}
+
+	return done;
+}
+
+/* Flush fp and wait until its data is on disk. */
+bool
+SyncFile(file* fp)
+{
+	return fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+}
+
+/*
+  Open a stream on a duplicate of file descriptor fd, so that closing
+  the stream leaves fd open. The two share a file position. Returns
+  NULL if fd can't be duplicated.
+*/
+file*
+OpenFd(int fd, char* mode)
+{
+	int dupfd = dup(fd);
+	file* fp;
+
+	if (dupfd < 0) {
+		return NULL;
+	}
+	if (fp = fdopen(dupfd, mode), !fp) {
+		(void) close(dupfd);
+		return NULL;
+	}
+	return fp;
+}
+
+/*
+  Move stdout to a new stream for data and point file descriptor 1,
+  where Println() writes, at stderr. Messages then can't end up in
+  the data. Returns NULL if stdout can't be duplicated.
+*/
+file*
+TakeStdout(void)
+{
+	int fd = dup(STDOUT_FILENO);
+	file* out;
+
+	if (fd < 0) {
+		return NULL;
+	}
+	if (out = fdopen(fd, "w"), !out) {
+		(void) close(fd);
+		return NULL;
+	}
+
+	(void) fflush(stdout);
+	(void) dup2(STDERR_FILENO, STDOUT_FILENO);
+	return out;
+}
+
+/* Give to's file the permission bits of from's file. */
+bool
+CopyFileMode(file* from, file* to)
+{
+	struct stat st;
+
+	return fstat(fileno(from), &st) == 0 && fchmod(fileno(to), st.st_mode & 07777) == 0;
+}
+
+/*
+  Shift everything from x0 to the end of the file by offset bytes
+  without copying it. A positive offset inserts a hole of offset bytes
+  at x0, a negative one removes the -offset bytes before x0.
+
+  This needs FALLOC_FL_INSERT_RANGE/FALLOC_FL_COLLAPSE_RANGE (ext4,
+  XFS) and both x0 and offset must be multiples of the filesystem's
+  block size. Returns false, with the file untouched, otherwise.
+*/
+bool
+ShiftFileExtents(file* fp, i64 offset, size x0)
+{
+#if defined(FALLOC_FL_INSERT_RANGE) && defined(FALLOC_FL_COLLAPSE_RANGE) \
+	&& !defined(AAR_NO_KERNEL_COPY)
+	int fd = fileno(fp);
+	size len = (offset < 0) ? -offset : offset;
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || st.st_blksize <= 0) {
+		return false;
+	}
+
+	if (x0 % st.st_blksize != 0 || len % st.st_blksize != 0) {
+		return false;
+	}
+
+	if (offset > 0) {
+		return fallocate(fd, FALLOC_FL_INSERT_RANGE, x0, len) == 0;
+	}
+	return x0 >= len && fallocate(fd, FALLOC_FL_COLLAPSE_RANGE, x0 - len, len) == 0;
+#else
+	(void) fp, (void) offset, (void) x0;
+	return false;
+#endif
+}
+
+/*
+  Copy len bytes from src in fin to dst in fout inside the kernel with
+  copy_file_range(2). Within one file the ranges must not overlap.
+  Returns the number of bytes copied, which is short if the call isn't
+  supported or fails part way. Threads may call this at once, so the
+  flag that stops retrying an unsupported call is atomic.
+*/
+size
+CopyFileRange(file* fin, size src, file* fout, size dst, size len)
+{
+#if defined(__linux__) && !defined(AAR_NO_KERNEL_COPY)
+	static int unsupported;
+	loff_t in = src;
+	loff_t out = dst;
+	size done = 0;
+
+	while (!__atomic_load_n(&unsupported, __ATOMIC_RELAXED) && done < len) {
+		ssize_t n = copy_file_range(fileno(fin), &in, fileno(fout), &out, len - done, 0);
+		if (n <= 0) {
+			// Don't keep trying on kernels or filesystems without it.
+			if (n < 0 && done == 0) {
+				__atomic_store_n(&unsupported, 1, __ATOMIC_RELAXED);
+			}
+			break;
+		}
+		done += n;
+	}
+
+	return done;
+#else
+	(void) fin, (void) src, (void) fout, (void) dst, (void) len;
+	return 0;
+#endif
+}
+
+/*
+  Make len bytes at dst in fout share storage with the bytes at src in
+  fin, with the FICLONERANGE ioctl(2) (btrfs, XFS). Both offsets and
+  len must be multiples of the filesystem's block size, though len may
+  run to the end of fin. Returns false, with nothing done, otherwise.
+*/
+bool
+CloneFileRange(file* fin, size src, file* fout, size dst, size len)
+{
+#if defined(FICLONERANGE) && !defined(AAR_NO_KERNEL_COPY)
+	struct file_clone_range range;
+
+	range.src_fd = fileno(fin);
+	range.src_offset = src;
+	range.src_length = len;
+	range.dest_offset = dst;
+
+	return ioctl(fileno(fout), FICLONERANGE, &range) == 0;
+#else
+	(void) fin, (void) src, (void) fout, (void) dst, (void) len;
+	return false;
+#endif
+}
+
+/*
+  Keep len bytes at p out of swap. This is best effort: it fails
+  quietly when RLIMIT_MEMLOCK is too small.
+*/
+bool
+LockMemory(void* p, size len)
+{
+	return mlock(p, len) == 0;
+}
+
+void
+UnlockMemory(void* p, size len)
+{
+	(void) munlock(p, len);
+}
+
+/*
+  Map the first len bytes of fp's file for reading and writing. Writes
+  go straight to the file. Returns NULL if the file can't be mapped.
+*/
+byte*
+MapFile(file* fp, size len)
+{
+	void* p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0);
+	return (p == MAP_FAILED) ? NULL : p;
+}
+
+void
+UnmapFile(byte* p, size len)
+{
+	(void) munmap(p, len);
+}
+
 aes_key_ok
 GenerateKey()
 {
@@ -45,3 +279,95 @@ error:
 	fclose(fp);
 	return result;
 }
+
+/* Return the number of online processors, or 1 if unknown. */
+size
+CpuCount(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) {
+		return n;
+	}
+#endif
+	return 1;
+}
+
+typedef struct {
+	void (*fn)(void* ctx, size job);
+	void* ctx;
+	size jobs;
+	size next;            // Next job to hand out. Guarded by lock.
+	pthread_mutex_t lock;
+} parallel_for;
+
+static void*
+ParallelWorker(void* arg)
+{
+	parallel_for* p = arg;
+
+	for (;;) {
+		size job;
+
+		pthread_mutex_lock(&p->lock);
+		job = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		if (job >= p->jobs) {
+			break;
+		}
+		p->fn(p->ctx, job);
+	}
+
+	return NULL;
+}
+
+/*
+  Call fn(ctx, job) for every job in [0, jobs) using up to threads
+  threads, including the calling thread. Jobs are handed out in order
+  from a shared counter. Returns once every job has finished.
+
+  If a thread can't be created, the remaining threads pick up its
+  share of the work. threads is cut down to jobs, and the thread IDs
+  are kept on the heap, so any threads, including 0, is safe.
+*/
+void
+ParallelFor(size jobs, size threads, void (*fn)(void* ctx, size job), void* ctx)
+{
+	pthread_t* tids = NULL;
+
+	if (threads > jobs) {
+		threads = jobs;
+	}
+	if (threads > 1) {
+		tids = calloc(threads - 1, sizeof(pthread_t));
+	}
+
+	// One thread, or no memory for more.
+	if (!tids) {
+		for (size job = 0; job < jobs; job++) {
+			fn(ctx, job);
+		}
+		return;
+	}
+
+	parallel_for p = {fn, ctx, jobs, 0};
+	size spawned = 0;
+
+	pthread_mutex_init(&p.lock, NULL);
+
+	for (; spawned < threads - 1; spawned++) {
+		if (pthread_create(&tids[spawned], NULL, ParallelWorker, &p) != 0) {
+			break;
+		}
+	}
+
+	(void) ParallelWorker(&p);
+
+	for (size i = 0; i < spawned; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	pthread_mutex_destroy(&p.lock);
+	free(tids);
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+
+set -e
+
+# The archive is extracted from inside a directory, so AAR, which may
+# be relative, must not be.
+AAR=$(cd "$(dirname "${AAR}")" && pwd)/$(basename "${AAR}")
+TMP=${TEST}.tmp
+
+# Files are written in the order given, however they're encrypted.
+${AAR} -k ${KEY} -a ${TMP} --align=4K new
+${AAR} -k ${KEY} -a ${TMP} add --files archive_add.3.in archive_add.1.in
+printf 'archive_add.2.in\0archive_add.3.in' | ${AAR} -k ${KEY} -a ${TMP} -j 2 --io-buffer=64 add --files
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+printf '0    archive_add.3.in\n1    archive_add.1.in\n2    archive_add.2.in\n3    archive_add.3.in\n' | cmp - ${TEST}.x.tmp
+
+mkdir ${TEST}.d.tmp
+(cd ${TEST}.d.tmp && ${AAR} -k ${KEY} -a ../${TMP} extract-all)
+for f in 1 2 3; do
+	cmp archive_add.${f}.in ${TEST}.d.tmp/archive_add.${f}.in
+done
+rm -rf ${TEST}.d.tmp
+
+# A file that can't be read fails the command, the others are added.
+if ${AAR} -k ${KEY} -a ${TMP} add --files missing.in archive_add.1.in; then
+	exit 1
+fi
+${AAR} -k ${KEY} -a ${TMP} list | grep -q '4    archive_add.1.in'
@@ -0,0 +1,17 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+# The data's length is only known at the end of the pipe.
+${AAR} -k ${KEY} -a ${TMP} new
+cat archive_add.2.in archive_add.3.in | ${AAR} -k ${KEY} -a ${TMP} --io-buffer=64 add - both
+${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in after
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+printf '0    both\n1    after\n' | cmp - ${TEST}.x.tmp
+
+${AAR} -k ${KEY} -a ${TMP} extract 0 1
+cat archive_add.2.in archive_add.3.in | cmp - both
+cmp archive_add.1.in after
+rm -f both after
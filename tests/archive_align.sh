@@ -0,0 +1,24 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+${AAR} -k ${KEY} -a ${TMP} --align=4K new
+${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in a.x.tmp
+${AAR} -k ${KEY} -a ${TMP} add checksum_verify.in b.x.tmp
+${AAR} -k ${KEY} -a ${TMP} add archive_add.2.in c.x.tmp
+
+# Renaming and deleting move whole 4K blocks around the records.
+${AAR} -k ${KEY} -a ${TMP} rename 1 a-longer-description-that-grows-the-header.x.tmp
+${AAR} -k ${KEY} -a ${TMP} delete 0
+
+${AAR} -k ${KEY} -a ${TMP} extract-all
+cmp checksum_verify.in a-longer-description-that-grows-the-header.x.tmp
+cmp archive_add.2.in c.x.tmp
+
+# Split records keep the alignment.
+rm -f c.x.tmp
+${AAR} -k ${KEY} -a ${TMP} split
+${AAR} -k ${KEY} decrypt c.x.tmp
+cmp archive_add.2.in c.x.tmp
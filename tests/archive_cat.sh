@@ -0,0 +1,30 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+${AAR} -k ${KEY} -a ${TMP} new
+${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in foo
+${AAR} -k ${KEY} -a ${TMP} add archive_add.2.in bar
+
+# Only the records' data reaches stdout.
+${AAR} -k ${KEY} -a ${TMP} cat 1 | cmp - archive_add.2.in
+${AAR} -k ${KEY} -a ${TMP} extract --stdout 0 1 > ${TEST}.x.tmp
+cat archive_add.1.in archive_add.2.in | cmp - ${TEST}.x.tmp
+${AAR} -k ${KEY} -a ${TMP} extract 1 --stdout | cmp - archive_add.2.in
+
+# Records are numbers.
+if ${AAR} -k ${KEY} -a ${TMP} extract 1 one > /dev/null; then
+	exit 1
+fi
+
+# Byte ranges only decrypt the blocks they cover.
+${AAR} -k ${KEY} -a ${TMP} cat 1 --offset=1 --length=2 > ${TEST}.x.tmp
+tail -c +2 archive_add.2.in | head -c 2 | cmp - ${TEST}.x.tmp
+
+# A corrupted record fails the command. foo's data starts at byte 112.
+printf 'ZZZZZZZZZZZZZZZZ' | dd of=${TMP} bs=1 seek=112 conv=notrunc 2> /dev/null
+if ${AAR} -k ${KEY} -a ${TMP} cat 0 > /dev/null; then
+	exit 1
+fi
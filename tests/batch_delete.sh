@@ -0,0 +1,39 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+# Record numbers count from before the delete, in any order.
+for align in "" --align=4K; do
+	rm -f ${TMP}
+	${AAR} -k ${KEY} -a ${TMP} ${align} new
+	for r in a b c d e f; do
+		${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in ${r}
+	done
+	${AAR} -k ${KEY} -a ${TMP} delete 4 1 9 1 5 0
+	${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+	printf '0    c\n1    d\n' | cmp - ${TEST}.x.tmp
+
+	# The index is right, and so are the records behind it.
+	printf 'ZZZZ' | dd of=${TMP} bs=1 seek=$(($(wc -c < ${TMP}) - 4)) conv=notrunc 2> /dev/null
+	${AAR} -k ${KEY} -a ${TMP} list | grep -v Warning > ${TEST}.x.tmp
+	printf '0    c\n1    d\n' | cmp - ${TEST}.x.tmp
+	${AAR} -k ${KEY} -a ${TMP} extract 1
+	cmp d archive_add.1.in
+	rm -f d
+done
+
+# Nothing to delete is a usage error.
+if ${AAR} -k ${KEY} -a ${TMP} delete > ${TEST}.x.tmp; then
+	exit 1
+fi
+grep -q 'Supply the numbers' ${TEST}.x.tmp
+
+# So is anything but record numbers, and nothing is deleted.
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.y.tmp
+if ${AAR} -k ${KEY} -a ${TMP} delete 0 foo > ${TEST}.x.tmp; then
+	exit 1
+fi
+grep -q "Invalid record number 'foo'" ${TEST}.x.tmp
+${AAR} -k ${KEY} -a ${TMP} list | cmp - ${TEST}.y.tmp
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2024 Paco Pascal <me@pacopascal.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+  Run a command and print one tab separated line of measurements to
+  stdout, or append it to FILE when -o is given:
+
+      LABEL  STATUS  WALL_SECONDS  MAXRSS_KB  RCHAR  WCHAR  SYSCR  SYSCW
+
+  RCHAR/WCHAR are the bytes passed to read and write style syscalls, and
+  SYSCR/SYSCW count those syscalls. They come from /proc/PID/io, which
+  is read while the child is a zombie, so they are only available on
+  Linux. Elsewhere they are printed as '-'.
+
+  Usage: measure [-o FILE] LABEL COMMAND [ARGS...]
+*/
+
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+typedef struct {
+	char rchar[32];
+	char wchar[32];
+	char syscr[32];
+	char syscw[32];
+} proc_io;
+
+static void
+ReadProcIo(pid_t pid, proc_io* io)
+{
+	char path[64], line[128];
+	strcpy(io->rchar, "-");
+	strcpy(io->wchar, "-");
+	strcpy(io->syscr, "-");
+	strcpy(io->syscw, "-");
+
+	snprintf(path, sizeof(path), "/proc/%ld/io", (long) pid);
+	FILE* fp = fopen(path, "r");
+	if (!fp) {
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		char key[32], value[32];
+		if (sscanf(line, "%31[^:]: %31s", key, value) != 2) {
+			continue;
+		}
+		if (!strcmp(key, "rchar")) {
+			strcpy(io->rchar, value);
+		} else if (!strcmp(key, "wchar")) {
+			strcpy(io->wchar, value);
+		} else if (!strcmp(key, "syscr")) {
+			strcpy(io->syscr, value);
+		} else if (!strcmp(key, "syscw")) {
+			strcpy(io->syscw, value);
+		}
+	}
+
+	fclose(fp);
+}
+
+static double
+Now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+main(int argc, char** argv)
+{
+	proc_io io;
+	siginfo_t info;
+	struct rusage usage;
+	int status;
+	FILE* out = stdout;
+	char* prog = argv[0];
+
+	if (argc >= 3 && !strcmp(argv[1], "-o")) {
+		if (out = fopen(argv[2], "a"), !out) {
+			perror(argv[2]);
+			return 2;
+		}
+		argc -= 2;
+		argv += 2;
+	}
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s [-o FILE] LABEL COMMAND [ARGS...]\n", prog);
+		return 2;
+	}
+
+	double start = Now();
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		perror("fork");
+		return 2;
+	}
+
+	if (pid == 0) {
+		execvp(argv[2], argv + 2);
+		perror(argv[2]);
+		_exit(127);
+	}
+
+	// Leave the child as a zombie so its /proc entry is still readable.
+	if (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) == -1) {
+		perror("waitid");
+		return 2;
+	}
+	double wall = Now() - start;
+
+	ReadProcIo(pid, &io);
+
+	if (waitpid(pid, &status, 0) == -1) {
+		perror("waitpid");
+		return 2;
+	}
+	getrusage(RUSAGE_CHILDREN, &usage);
+
+	fprintf(out, "%s\t%d\t%.6f\t%ld\t%s\t%s\t%s\t%s\n",
+		argv[1],
+		WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+		wall,
+		(long) usage.ru_maxrss,
+		io.rchar, io.wchar, io.syscr, io.syscw);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+	return 0;
+}
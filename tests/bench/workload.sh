@@ -0,0 +1,124 @@
+#!/bin/sh
+#
+# End-to-end workload benchmark for aar.
+#
+# Builds a synthetic archive of BENCH_RECORDS records, BENCH_SIZE bytes
+# each, then runs every command against a fresh copy of it under
+# ./measure. Results go to BENCH_OUT as tab separated values with the
+# columns below, and are echoed as a table.
+#
+#   AAR            aar binary (default ../../aar)
+#   MEASURE        measure binary (default ./measure)
+#   BENCH_RECORDS  Records in the archive, 1 to 1000000 (default 1000)
+#   BENCH_SIZE     Bytes in each record (default 4096)
+#   BENCH_JOBS     Passed to aar's -j when set
+#   BENCH_DIR      Scratch directory (default: mktemp -d, removed after)
+#   BENCH_OUT      Results file (default workload.tsv)
+#   BENCH_STRACE   Set to 1 to also count all syscalls with strace -f -c
+#
+# The archive is built by copying the bytes of one record over and
+# over, so even a million records only takes seconds. A final `add`
+# writes the record index.
+
+set -e
+
+AAR=$(cd "$(dirname "${AAR:-../../aar}")" && pwd)/$(basename "${AAR:-../../aar}")
+MEASURE=$(cd "$(dirname "${MEASURE:-./measure}")" && pwd)/$(basename "${MEASURE:-./measure}")
+KEY=${KEY:-AAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAAA=}
+RECORDS=${BENCH_RECORDS:-1000}
+SIZE=${BENCH_SIZE:-4096}
+OUT=$(pwd)/${BENCH_OUT:-workload.tsv}
+
+if [ "$RECORDS" -lt 1 ] || [ "$RECORDS" -gt 1000000 ]; then
+	echo "BENCH_RECORDS must be between 1 and 1000000." >&2
+	exit 1
+fi
+
+if [ -n "$BENCH_DIR" ]; then
+	DIR=$BENCH_DIR
+	mkdir -p "$DIR"
+else
+	DIR=$(mktemp -d)
+	trap 'rm -rf "$DIR"' EXIT
+fi
+
+JOBS=
+if [ -n "$BENCH_JOBS" ]; then
+	JOBS="-j $BENCH_JOBS"
+fi
+
+cd "$DIR"
+mkdir -p out
+
+# `split` writes a record out byte for byte after a 32 byte format
+# block, and records start where the empty archive ends.
+head -c "$SIZE" /dev/urandom > data.in
+"$AAR" -k "$KEY" -a base.aar new > /dev/null
+"$AAR" -k "$KEY" -a one.aar new > /dev/null
+"$AAR" -k "$KEY" -a one.aar add data.in record > /dev/null
+mkdir one
+(cd one && "$AAR" -k "$KEY" -a ../one.aar split > /dev/null)
+tail -c +33 one/record > chunk.bin
+rm -rf one one.aar
+
+n=$((RECORDS - 1))
+while [ "$n" -gt 0 ]; do
+	if [ $((n % 2)) -eq 1 ]; then
+		cat chunk.bin >> base.aar
+	fi
+	n=$((n / 2))
+	if [ "$n" -gt 0 ]; then
+		cat chunk.bin chunk.bin > chunk.tmp
+		mv chunk.tmp chunk.bin
+	fi
+done
+rm -f chunk.bin
+"$AAR" -k "$KEY" -a base.aar add data.in record > /dev/null
+
+printf 'op\tstatus\twall_s\tmaxrss_kb\trchar\twchar\tsyscr\tsyscw\n' > "$OUT"
+
+# Run one command from inside out/ on a fresh copy of the archive, with
+# $INPUT copied to out/data.tmp.
+run() {
+	op=$1
+	shift
+	cp base.aar work.aar
+	rm -f out/*
+	cp "$INPUT" out/data.tmp
+	(cd out && "$MEASURE" -o "$OUT" "$op" "$@" > /dev/null 2>&1) || true
+	if [ "$BENCH_STRACE" = 1 ]; then
+		cp base.aar work.aar
+		rm -f out/*
+		cp "$INPUT" out/data.tmp
+		(cd out && strace -f -c -o ../strace.tmp "$@" > /dev/null 2>&1) || true
+		printf '%s\t' "$op" >> strace.tsv
+		awk '$NF == "total" { print $(NF-1) }' strace.tmp >> strace.tsv
+	fi
+}
+
+A="$AAR -k $KEY -a ../work.aar $JOBS"
+LAST=$((RECORDS - 1))
+
+INPUT=data.in
+rm -f strace.tsv
+run add          $A add data.tmp added
+run list         $A list
+run extract      $A extract $LAST
+run extract-all  $A extract-all
+run delete-first $A delete 0
+run delete-last  $A delete $LAST
+run rename       $A rename 0 renamed
+run split        $A split
+run encrypt      "$AAR" -k "$KEY" $JOBS encrypt data.tmp
+cp data.in data.enc
+"$AAR" -k "$KEY" encrypt data.enc > /dev/null
+INPUT=data.enc
+run decrypt      "$AAR" -k "$KEY" $JOBS decrypt data.tmp
+
+echo "records=$RECORDS size=$SIZE archive=$(wc -c < base.aar) bytes"
+column -t "$OUT" 2> /dev/null || cat "$OUT"
+if [ -f strace.tsv ]; then
+	echo
+	echo "syscalls (strace -f -c):"
+	column -t strace.tsv 2> /dev/null || cat strace.tsv
+fi
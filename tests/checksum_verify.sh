@@ -0,0 +1,18 @@
+#!/bin/sh
+
+set -e
+
+IN=${TEST}.in
+TMP=${TEST}.tmp
+OUT=${TEST}.x.tmp
+
+${AAR} -k ${KEY} -a ${TMP} new
+${AAR} -k ${KEY} -a ${TMP} add ${IN} ${OUT}
+
+# An intact record extracts quietly.
+${AAR} -k ${KEY} -a ${TMP} extract 0 | grep -v -q "Checksum mismatch"
+cmp ${IN} ${OUT}
+
+# Flip a byte in the middle of the record's data.
+printf 'Z' | dd of=${TMP} bs=1 seek=400 conv=notrunc 2> /dev/null
+${AAR} -k ${KEY} -a ${TMP} extract 0 | grep -q "Checksum mismatch"
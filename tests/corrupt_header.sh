@@ -0,0 +1,36 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+${AAR} -k ${KEY} -a ${TMP} new
+for r in foo bar baz qux; do
+	${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in ${r}
+done
+
+# Flip a byte of bar's header, which follows foo's data at byte 112,
+# and of the record index, so the records are walked.
+hdr=$((112 + ($(wc -c < archive_add.1.in) + 15) / 16 * 16 + 16))
+printf 'Z' | dd of=${TMP} bs=1 seek=$((hdr + 3)) conv=notrunc 2> /dev/null
+printf 'ZZZZ' | dd of=${TMP} bs=1 seek=$(($(wc -c < ${TMP}) - 4)) conv=notrunc 2> /dev/null
+cp ${TMP} ${TEST}.orig.tmp
+
+# A corrupted header isn't the end of the archive. Every walk fails
+# there and nothing is changed.
+for cmd in list split extract-all "delete 2"; do
+	if ${AAR} -k ${KEY} -a ${TMP} ${cmd} > ${TEST}.x.tmp; then
+		exit 1
+	fi
+	grep -q 'header of record 1 is corrupted' ${TEST}.x.tmp
+	cmp ${TMP} ${TEST}.orig.tmp
+done
+rm -f foo
+
+# compact leaves the archive alone rather than drop the records after
+# the corrupted header.
+if ${AAR} -k ${KEY} -a ${TMP} compact > ${TEST}.x.tmp; then
+	exit 1
+fi
+cmp ${TMP} ${TEST}.orig.tmp
+test ! -e ${TMP}.compact
@@ -0,0 +1,34 @@
+#!/bin/sh
+
+set -e
+
+# Many files are encrypted at once, each as if it were alone.
+for f in a b c d e; do
+	cp encrypt_file.in ${TEST}.${f}.tmp
+done
+${AAR} -k ${KEY} -j 4 encrypt ${TEST}.a.tmp ${TEST}.b.tmp ${TEST}.c.tmp ${TEST}.d.tmp ${TEST}.e.tmp > ${TEST}.x.tmp
+grep -q '^Encrypted 5 of 5 files.$' ${TEST}.x.tmp
+for f in a b c d e; do
+	cmp encrypt_file.out ${TEST}.${f}.tmp
+done
+
+# Every file is reported in order, and failures fail the command.
+if ${AAR} -k ${KEY} -j 4 decrypt ${TEST}.a.tmp missing.tmp ${TEST}.b.tmp > ${TEST}.x.tmp; then
+	exit 1
+fi
+printf '%s\n' \
+	"Decrypting '${TEST}.a.tmp' ..." \
+	"Failed to open 'missing.tmp'." \
+	"Decrypting '${TEST}.b.tmp' ..." \
+	"Decrypted 2 of 3 files." | cmp - ${TEST}.x.tmp
+cmp encrypt_file.in ${TEST}.a.tmp
+cmp encrypt_file.in ${TEST}.b.tmp
+
+# A corrupted file is still decrypted, with a warning.
+printf 'X' | dd of=${TEST}.c.tmp bs=1 seek=40 conv=notrunc 2> /dev/null
+if ${AAR} -k ${KEY} decrypt ${TEST}.c.tmp ${TEST}.d.tmp > ${TEST}.x.tmp; then
+	exit 1
+fi
+grep -q '^Warning: Checksum mismatch' ${TEST}.x.tmp
+grep -q '^Decrypted 1 of 2 files.$' ${TEST}.x.tmp
+cmp encrypt_file.in ${TEST}.d.tmp
@@ -0,0 +1,52 @@
+#!/bin/sh
+
+set -e
+
+# The archive is extracted from inside a directory, so AAR, which may
+# be relative, must not be.
+AAR=$(cd "$(dirname "${AAR}")" && pwd)/$(basename "${AAR}")
+TMP=${TEST}.tmp
+
+awk 'BEGIN { for (i = 0; i < 100; i++) print i }' > ${TEST}.big.tmp
+
+# The second record named archive_add.1.in replaces the first one.
+${AAR} -k ${KEY} -a ${TMP} new
+${AAR} -k ${KEY} -a ${TMP} add --files archive_add.1.in archive_add.2.in archive_add.3.in
+${AAR} -k ${KEY} -a ${TMP} add archive_add.3.in archive_add.1.in
+${AAR} -k ${KEY} -a ${TMP} add ${TEST}.big.tmp big
+${AAR} -k ${KEY} -a ${TMP} add archive_add.2.in last
+
+# Every batch size gives the same files and the same messages, in
+# record order. A 64 byte IO buffer holds two small records, and the
+# big one is streamed on its own.
+for opts in "-j 1" "-j 4" "-j 4 --io-buffer=64"; do
+	rm -rf ${TEST}.d.tmp
+	mkdir ${TEST}.d.tmp
+	(cd ${TEST}.d.tmp && ${AAR} -k ${KEY} -a ../${TMP} ${opts} extract-all) > ${TEST}.x.tmp
+	printf '%s\n' \
+		'Extracting record 0 as archive_add.1.in' \
+		'Extracting record 1 as archive_add.2.in' \
+		'Extracting record 2 as archive_add.3.in' \
+		'Extracting record 3 as archive_add.1.in' \
+		'Extracting record 4 as big' \
+		'Extracting record 5 as last' | cmp - ${TEST}.x.tmp
+	cmp archive_add.3.in ${TEST}.d.tmp/archive_add.1.in
+	cmp archive_add.2.in ${TEST}.d.tmp/archive_add.2.in
+	cmp archive_add.3.in ${TEST}.d.tmp/archive_add.3.in
+	cmp ${TEST}.big.tmp ${TEST}.d.tmp/big
+	cmp archive_add.2.in ${TEST}.d.tmp/last
+done
+rm -rf ${TEST}.d.tmp
+
+# A corrupted record is still extracted, but fails the command. foo's
+# data starts at byte 112.
+rm -f ${TMP}
+${AAR} -k ${KEY} -a ${TMP} new
+${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in foo
+printf 'ZZZZZZZZZZZZZZZZ' | dd of=${TMP} bs=1 seek=112 conv=notrunc 2> /dev/null
+mkdir ${TEST}.d.tmp
+if (cd ${TEST}.d.tmp && ${AAR} -k ${KEY} -a ../${TMP} extract-all) > /dev/null; then
+	exit 1
+fi
+test -f ${TEST}.d.tmp/foo
+rm -rf ${TEST}.d.tmp
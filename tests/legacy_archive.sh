@@ -0,0 +1,13 @@
+#!/bin/sh
+
+set -e
+
+OUT=${TEST}.out
+TMP=${TEST}.tmp
+
+# ${TEST}.1.in predates the format block. Records added to it must
+# keep using the legacy checksum.
+cp ${TEST}.1.in $TMP
+${AAR} -k ${KEY} -a ${TMP} add ${TEST}.2.in bar
+
+cmp $OUT $TMP
@@ -0,0 +1,38 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+${AAR} -k ${KEY} -a ${TMP} --log new
+${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in foo
+${AAR} -k ${KEY} -a ${TMP} add archive_add.2.in bar
+${AAR} -k ${KEY} -a ${TMP} add archive_add.3.in baz
+size=$(wc -c < ${TMP})
+${AAR} -k ${KEY} -a ${TMP} delete 1
+${AAR} -k ${KEY} -a ${TMP} rename 0 qux
+
+# Deletes and renames only append to the archive.
+[ $(wc -c < ${TMP}) -gt ${size} ]
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+printf '0    qux\n1    baz\n' | cmp - ${TEST}.x.tmp
+
+# Without the index the log is replayed from the records.
+printf 'ZZZZ' | dd of=${TMP} bs=1 seek=$(($(wc -c < ${TMP}) - 4)) conv=notrunc 2> /dev/null
+${AAR} -k ${KEY} -a ${TMP} list | grep -v Warning > ${TEST}.x.tmp
+printf '0    qux\n1    baz\n' | cmp - ${TEST}.x.tmp
+
+${AAR} -k ${KEY} -a ${TMP} extract-all
+cmp qux archive_add.1.in
+cmp baz archive_add.3.in
+rm -f qux baz
+
+# Compacting drops the log and the deleted record.
+size=$(wc -c < ${TMP})
+${AAR} -k ${KEY} -a ${TMP} compact
+[ $(wc -c < ${TMP}) -lt ${size} ]
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+printf '0    qux\n1    baz\n' | cmp - ${TEST}.x.tmp
+${AAR} -k ${KEY} -a ${TMP} extract 0
+cmp qux archive_add.1.in
+rm -f qux
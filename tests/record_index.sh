@@ -0,0 +1,22 @@
+#!/bin/sh
+
+set -e
+
+TMP=${TEST}.tmp
+
+${AAR} -k ${KEY} -a ${TMP} new
+${AAR} -k ${KEY} -a ${TMP} add archive_add.1.in foo
+${AAR} -k ${KEY} -a ${TMP} add archive_add.2.in bar
+${AAR} -k ${KEY} -a ${TMP} add archive_add.3.in baz
+${AAR} -k ${KEY} -a ${TMP} delete 1
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+printf '0    foo\n1    baz\n' | cmp - ${TEST}.x.tmp
+
+# Damage the index at the end. The records are read one by one
+# instead, and the next change writes a new index.
+printf 'ZZZZ' | dd of=${TMP} bs=1 seek=$(($(wc -c < ${TMP}) - 4)) conv=notrunc 2> /dev/null
+${AAR} -k ${KEY} -a ${TMP} list | grep -q "index doesn't match"
+${AAR} -k ${KEY} -a ${TMP} list | grep -q "1    baz"
+${AAR} -k ${KEY} -a ${TMP} rename 0 qux
+${AAR} -k ${KEY} -a ${TMP} list > ${TEST}.x.tmp
+printf '0    qux\n1    baz\n' | cmp - ${TEST}.x.tmp